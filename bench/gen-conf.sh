@@ -0,0 +1,39 @@
+#!/bin/sh
+# Generate a synthetic tmpfiles.d corpus on stdout
+#	gen-conf.sh ROOT LINES
+# Lines cycle through d,f,w,x,r and glob entries under ROOT/conf,with a
+# comment every 16 lines.The output only depends on the arguments.
+
+root=$1
+lines=$2
+
+if [ -z "$root" ] || [ -z "$lines" ]; then
+	echo "usage: $0 ROOT LINES" >&2
+	exit 1
+fi
+
+awk -v root="$root/conf" -v lines="$lines" 'BEGIN {
+	for (i = 0; i < lines; i++) {
+		dir = sprintf("%s/%d", root, i % 64);
+		if (i % 16 == 0) {
+			printf("# Comment line %d\n", i);
+			continue;
+		}
+		t = i % 7;
+		if (t == 0)
+			printf("d %s 0755 - - 10d\n", dir);
+		else if (t == 1)
+			printf("f %s/file%d 0644 - - - content %d\n", dir, i, i);
+		else if (t == 2)
+			printf("w %s/file%d - - - - \"quoted\\tvalue %d\"\n",
+			       dir, i - 1, i);
+		else if (t == 3)
+			printf("d %s/sub%d 0700 - - 1h\n", dir, i);
+		else if (t == 4)
+			printf("x %s/keep%d - - - -\n", dir, i);
+		else if (t == 5)
+			printf("r %s/stale%d - - - -\n", dir, i);
+		else
+			printf("r %s/glob*%d - - - -\n", dir, i);
+	}
+}'
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Generate a reproducible directory tree for benchmarking
+#	gen-tree.sh SHAPE DIR [FS]
+# SHAPE is one of
+#	wide	one level of 64 directories with 256 files each
+#	deep	a chain of 256 nested directories with 8 files at each level
+#	small	16x16 directories with 64 small files each
+# FS is one of tmpfs,ext4,btrfs.When given (root only),DIR is mounted as a
+# fresh file system of that type first,loop images are kept in $TMPDIR.
+# Files named "old*" are dated 2000-01-01,others are left new.
+
+set -e
+
+shape=$1
+dir=$2
+fs=$3
+
+if [ -z "$shape" ] || [ -z "$dir" ]; then
+	echo "usage: $0 wide|deep|small DIR [tmpfs|ext4|btrfs]" >&2
+	exit 1
+fi
+
+mount_fs() {
+	mkdir -p "$dir"
+	if mountpoint -q "$dir"; then
+		umount "$dir"
+	fi
+	case $fs in
+	tmpfs)
+		mount -t tmpfs -o size=512m tmpfs "$dir"
+		;;
+	ext4|btrfs)
+		img=${TMPDIR:-/tmp}/pawprint-bench-$fs.img
+		rm -f "$img"
+		truncate -s 1G "$img"
+		mkfs.$fs -q "$img" >/dev/null
+		mount -o loop "$img" "$dir"
+		;;
+	*)
+		echo "unknown file system $fs" >&2
+		exit 1
+		;;
+	esac
+}
+
+# files DIR NUM: create NUM files in DIR,every fourth one old
+files() {
+	i=0
+	while [ $i -lt "$2" ]; do
+		if [ $((i % 4)) -eq 0 ]; then
+			: > "$1/old$i"
+			touch -d 2000-01-01 "$1/old$i"
+		else
+			echo "$i" > "$1/file$i"
+		fi
+		i=$((i + 1))
+	done
+}
+
+if [ -n "$fs" ]; then
+	mount_fs
+else
+	rm -rf "$dir"
+	mkdir -p "$dir"
+fi
+
+case $shape in
+wide)
+	for a in $(seq 1 64); do
+		mkdir "$dir/$a"
+		files "$dir/$a" 256
+	done
+	;;
+deep)
+	p=$dir
+	for a in $(seq 1 256); do
+		p=$p/d
+		mkdir "$p"
+		files "$p" 8
+	done
+	;;
+small)
+	for a in $(seq 1 16); do
+		for b in $(seq 1 16); do
+			mkdir -p "$dir/$a/$b"
+			files "$dir/$a/$b" 64
+		done
+	done
+	;;
+*)
+	echo "unknown shape $shape" >&2
+	exit 1
+	;;
+esac
+
+# Directories themselves are old,so that only their contents decide
+find "$dir" -mindepth 1 -type d -exec touch -d 2000-01-01 {} +
@@ -0,0 +1,100 @@
+#!/bin/sh
+# Benchmark pawprint on generated trees and configuration corpora
+#	run.sh [FS]
+# Environment:
+#	BIN		pawprint binary (default ./pawprint,built if missing)
+#	TMPFILES	systemd-tmpfiles to compare with (default from PATH)
+#	WORK		working directory (default $TMPDIR/pawprint-bench)
+#	LINES		lines of the synthetic corpus (default 5000)
+#	JOBS		passed to --jobs (default 1)
+# FS is passed to gen-tree.sh,see there.
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+fs=$1
+BIN=${BIN:-./pawprint}
+TMPFILES=${TMPFILES:-$(command -v systemd-tmpfiles || true)}
+WORK=${WORK:-${TMPDIR:-/tmp}/pawprint-bench}
+LINES=${LINES:-5000}
+JOBS=${JOBS:-1}
+
+if [ ! -x "$BIN" ]; then
+	cc -O2 -pthread "$bench/../pawprint.c" -o "$BIN" \
+		-DARCH="$(uname -m | sed 's/^arm64$/aarch64/')"
+fi
+
+mkdir -p "$WORK"
+
+now_ns() {
+	date +%s%N
+}
+
+# json_calls FILE: the top-level call counters of a --stats=json output
+json_calls() {
+	sed -n 's/"handlers".*//;s/.*"calls":{\([^}]*\)}.*/\1/p' "$1"
+}
+
+# json_num FILE KEY
+json_num() {
+	sed -n "s/\"calls\".*//;s/.*\"$2\":\([0-9.]*\).*/\1/p" "$1"
+}
+
+# json_handler FILE NAME: calls and milliseconds of a handler
+json_handler() {
+	sed -n "s/.*\"$2\":{\"calls\":\([0-9]*\),\"ms\":\([0-9.]*\)}.*/\1 \2/p" \
+		"$1"
+}
+
+printf '%-8s%10s%10s%10s%10s%12s%12s%14s\n' shape entries \
+	clean_ms calls glob_ms syscalls entries/s tmpfiles_ms
+
+for shape in wide deep small; do
+	tree=$WORK/tree
+	conf=$WORK/$shape.conf
+	json=$WORK/$shape.json
+	cat > "$conf" <<CONF
+d $tree - - - 1d
+r $tree/*/nonexistent* - - - -
+CONF
+
+	"$bench/gen-tree.sh" "$shape" "$tree" $fs
+	entries=$(find "$tree" -mindepth 1 | wc -l)
+	"$BIN" --no-default --clean --create --remove --jobs "$JOBS" \
+		--stats=json "$conf" > "$json"
+
+	set -- $(json_handler "$json" attr_clean)
+	cleanCalls=$1
+	cleanMs=$2
+	globMs=$(json_num "$json" glob_ms)
+	executeMs=$(json_num "$json" execute_ms)
+	syscalls=$(json_calls "$json" | tr ',' '\n' |
+		   awk -F: '$1 != "\"bytes_written\"" { n += $2 } END { print n }')
+	perEntry=$(awk -v a="$syscalls" -v b="$entries" \
+		   'BEGIN { printf("%.2f", a / b) }')
+	rate=$(awk -v a="$entries" -v b="$executeMs" \
+	       'BEGIN { printf("%.0f", b > 0 ? a * 1000 / b : 0) }')
+
+	tmpfilesMs=-
+	if [ -n "$TMPFILES" ]; then
+		"$bench/gen-tree.sh" "$shape" "$tree" $fs
+		start=$(now_ns)
+		"$TMPFILES" --clean --create --remove "$conf" 2>/dev/null || true
+		tmpfilesMs=$(( ($(now_ns) - start) / 1000000 ))
+	fi
+
+	printf '%-8s%10s%10s%10s%10s%12s%12s%14s\n' "$shape" "$entries" \
+		"$cleanMs" "$cleanCalls" "$globMs" "$perEntry/entry" \
+		"$rate" "$tmpfilesMs"
+done
+
+# Parsing only: the corpus points at a missing directory,so nothing is touched
+corpus=$WORK/corpus.conf
+"$bench/gen-conf.sh" "$WORK/none" "$LINES" > "$corpus"
+"$BIN" --no-default --stats=json "$corpus" > "$WORK/corpus.json" 2>/dev/null
+echo
+echo "parse_conf: $LINES lines in $(json_num "$WORK/corpus.json" parse_ms) ms"
+
+if [ -n "$fs" ] && mountpoint -q "$WORK/tree"; then
+	umount "$WORK/tree"
+fi
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Measure exec-to-exit time of pawprint on an empty root
+#	startup.sh [RUNS]
+# Environment:
+#	BIN		pawprint binary (default ./pawprint,built if missing)
+#	WORK		working directory (default $TMPDIR/pawprint-bench)
+# --root needs chroot(),so without root privileges --no-default is run
+# instead. /bin/true is timed the same way,to tell the cost of exec.
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+runs=${1:-1000}
+BIN=${BIN:-./pawprint}
+WORK=${WORK:-${TMPDIR:-/tmp}/pawprint-bench}
+
+if [ ! -x "$BIN" ]; then
+	cc -O2 -pthread "$bench/../pawprint.c" -o "$BIN" \
+		-DARCH="$(uname -m | sed 's/^arm64$/aarch64/')"
+fi
+
+root=$WORK/empty
+rm -rf "$root"
+mkdir -p "$root"
+if [ "$(id -u)" -eq 0 ]; then
+	set -- --root "$root"
+else
+	set -- --no-default
+fi
+
+# per_run CMD...: microseconds per run of CMD
+per_run() {
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$runs" ]; do
+		"$@"
+		i=$((i + 1))
+	done
+	echo $(( ($(date +%s%N) - start) / runs / 1000 ))
+}
+
+true=$(per_run /bin/true)
+pawprint=$(per_run "$BIN" "$@" --create --boot)
+
+printf '%-24s%10s\n' command us/run
+printf '%-24s%10s\n' /bin/true "$true"
+printf '%-24s%10s\n' "pawprint --create --boot" "$pawprint"
@@ -7,14 +7,18 @@
  *	This project is a part of eweOS
  */
 
+#define _GNU_SOURCE
+
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<stdint.h>
+#include<stddef.h>
 #include<errno.h>
 #include<time.h>
 #include<stdbool.h>
-#include<stdarg.h>
+#include<ctype.h>
+#include<limits.h>
 
 #include<unistd.h>
 #include<sys/types.h>
@@ -23,10 +27,40 @@
 #include<dirent.h>
 #include<pwd.h>
 #include<grp.h>
-#include<glob.h>
 #include<fnmatch.h>
 #include<sys/ioctl.h>
 #include<linux/fs.h>
+#include<sys/resource.h>
+#include<pthread.h>
+#include<stdatomic.h>
+#include<sys/sysmacros.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sys/vfs.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sched.h>
+#include<linux/magic.h>
+#include<linux/btrfs.h>
+#include<sys/inotify.h>
+#include<poll.h>
+#include<sys/wait.h>
+#include<syslog.h>
+#include<stdarg.h>
+
+#if !defined(NO_IO_URING) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define HAVE_IO_URING
+		#include<linux/io_uring.h>
+	#endif
+#endif
+
+#if defined(__has_include)
+	#if __has_include(<linux/openat2.h>) && defined(SYS_openat2)
+		#define HAVE_OPENAT2
+		#include<linux/openat2.h>
+	#endif
+#endif
 
 #define x86_64	0
 #define aarch64	1
@@ -35,7 +69,7 @@
 #endif
 #if ARCH == x86_64
 	#define ARCH_FORMSTR "x86-64"
-#elif ARCH == "aarch64"
+#elif ARCH == aarch64
 	#define ARCH_FORMSTR "arm64"
 #else
 	#ifndef ARCH_FORMSTR
@@ -51,19 +85,42 @@ static struct {
 	int create:1;
 	int remove:1;
 	int noDefault:1;
-	char **excludedList;
-	int excludedCount;
+	int jobs;
+	bool ioUring;
+	const char *cachePath;
+	const char *ageIndexPath;
+	int stats;			// STATS_*
+	bool createFirst;
+	int readyFd;			// -1 if not given
+	const char *readyFile;
+	bool dryRun,estimate;
+	bool watch;
+	bool untilNext;
 } gArg;
 
+enum {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+	STATS_QUIET,			// Collected for --estimate only
+};
+
+static struct {
+	atomic_long skipped;		// Unnecessary metadata changes
+	atomic_long skippedDirs;	// Subtrees left out by the age index
+	atomic_long failedRemovals;	// Queued removals that failed
+} gCounter;
+
 /*
  *	NOTE:
  *		Remember to check parse_conf if these macros are changed
- *		Handlers are executed from the lowest bit to the highest
+ *		Handlers are executed in the order of gHandlers
  */
 #define s(k) (1 << (k))
 #define ATTR_FILE		s(0)		// File or directory
 #define ATTR_CREATE		s(1)		// Create or fail
 #define ATTR_APPEND		s(2)		// Append or not
+#define ATTR_SUBVOL		s(3)		// Create btrfs subvolume
 
 #define ATTR_PERM		s(4)		// Adjust permission
 #define ATTR_CREATEDIR		s(5)		// Create directory
@@ -75,7 +132,8 @@ static struct {
 #define ATTR_CLEAN		s(10)		// Need cleaning
 #define ATTR_REMOVE		s(11)		// Need removing
 #define ATTR_ATTR		s(12)		// Need setting attribute
-#define ATTR_EXCLUDE		s(13)		// Do not remove
+#define ATTR_EXCLUDE		s(13)		// Do not remove,see plan_resolve
+#define ATTR_ATTRTREE		s(14)		// Set attribute recursively
 
 #define ATTR_ONBOOT		s(30)		// On --boot only
 #define ATTR_GLOB		s(31)		// Need expanding
@@ -87,352 +145,3982 @@ typedef struct {
 	Entry_Attribute attr;
 } File_Entry;
 
-/*	Log  Macros	*/
-// For default,print log to stderr
-FILE *gLogStream;
-#define log_error(...) (fprintf(gLogStream,"[Error]:" __VA_ARGS__))
-#define log_warn(...)  (fprintf(gLogStream,"[Warning]:"  __VA_ARGS__))
-#define check(assertion,...) do {					\
-	if (!(assertion)) {						\
-		log_error(__VA_ARGS__);					\
-		exit(-1);						\
-	} } while(0)
-#define checkl(cond,log,...) ((void)(cond ? 0 : log_warn(log,__VA_ARGS__)))
+/*
+ *	Metrics (--metrics-file)
+ *	Every thread counts into its own Metrics,registered on first use,
+ *	so counting needs no atomics. They are merged when the file is
+ *	written,after the threads are done. The directory of the file is
+ *	opened before changing to a root. With several roots,every worker
+ *	leaves its sum in a shared slot and the parent writes the file.
+ */
+#define METRICS_TYPE_NUM	128
+#define METRICS_ERRNO_NUM	256		// Others are counted in [0]
 
-static const char *skip_space(const char *p)
-{
-	while ((*p == ' ' || *p == '\t') && *p)
-		p++;
-	return p;
-}
+typedef struct Metrics {
+	struct Metrics *next;
+	long int files[METRICS_TYPE_NUM];	// Paths processed by entry type
+	long int removed;			// Files and directories
+	uint64_t reclaimed;			// Allocated size freed by cleaning
+	long int errors[METRICS_ERRNO_NUM];
+	uint64_t globNs,walkNs;
+	uint64_t parseNs,executeNs;		// Set when merged
+} Metrics;
+
+static struct {
+	const char *path;
+	int dirFd;
+	const char *name;			// In dirFd
+	pthread_mutex_t lock;
+	Metrics *list;
+	Metrics *slots,*slot;			// With several roots
+} gMetrics = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+	     };
+
+static _Thread_local Metrics *tMetrics;
 
-static void next_line(FILE *fp)
+// NULL without --metrics-file
+static Metrics *metrics_get(void)
 {
-	while (fgetc(fp) != '\n');
-	return;
+	if (tMetrics || !gMetrics.path)
+		return tMetrics;
+
+	Metrics *m = calloc(1,sizeof(Metrics));
+	if (!m)				// Counted nowhere then
+		return NULL;
+
+	pthread_mutex_lock(&gMetrics.lock);
+	m->next		= gMetrics.list;
+	gMetrics.list	= m;
+	pthread_mutex_unlock(&gMetrics.lock);
+	tMetrics = m;
+	return m;
 }
 
-static void free_if(int num,...)
+/*
+ *	Log
+ *	Messages go to gLogStream (stderr,or the file of --log),which is
+ *	fully buffered and flushed on exit,to the journal or to syslog.
+ *	Each one is formatted into a single line before being written,so
+ *	lines from several threads do not interleave. log_errno() reports a
+ *	failed call,its errno value err is appended as the reason and counted
+ *	in the metrics.
+ *	Warnings are limited per format and entry of the configuration
+ *	(tLogEntry,set like tEntryStats): after LOG_BURST of them,the rest
+ *	are only counted and summarized when the entry is done.
+ */
+#define LOG_BURST		10
+#define LOG_LINE_SIZE		1024
+#define LOG_BUFFER_SIZE		65536
+
+enum {
+	LOG_TARGET_STREAM,
+	LOG_TARGET_JOURNAL,
+	LOG_TARGET_SYSLOG,
+};
+
+typedef struct {
+	const char *fmt;
+	size_t entry;
+	long int count;
+	char last[LOG_LINE_SIZE];
+} Log_Counter;
+
+FILE *gLogStream;
+static struct {
+	int level;			// Most verbose priority printed
+	int target;
+	int journalFd;
+	pthread_mutex_t lock;
+	Log_Counter *counters;
+	size_t counterNum,counterCap;
+} gLog = {
+		.level		= LOG_WARNING,
+		.journalFd	= -1,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+	 };
+
+// Index of the entry being executed plus one,zero if none
+static _Thread_local size_t tLogEntry;
+
+static void log_write(int level,const char *msg)
 {
-	va_list arg;
-	va_start(arg,num);
-	void *p;
+	if (gLog.target == LOG_TARGET_SYSLOG) {
+		syslog(level,"%s",msg);
+		return;
+	}
 
-	while (num) {
-		p = va_arg(arg,void *);
-		if (p)
-			free(p);
-		num--;
+	if (gLog.target == LOG_TARGET_JOURNAL) {
+		char buf[LOG_LINE_SIZE + 64];
+		int len = snprintf(buf,sizeof(buf),
+				   "PRIORITY=%d\nSYSLOG_IDENTIFIER=pawprint\n"
+				   "MESSAGE=%s\n",level,msg);
+		if (len > 0 && (size_t)len < sizeof(buf) &&
+		    send(gLog.journalFd,buf,len,MSG_NOSIGNAL) == len)
+			return;
 	}
 
-	va_end(arg);
+	fprintf(gLogStream,"%s%s\n",level == LOG_ERR	 ? "[Error]:"	:
+				    level == LOG_WARNING ? "[Warning]:"	:
+							   "[Info]:",msg);
 	return;
 }
 
-static int is_valid_file(const char *path)
+// Whether the message should be counted instead of printed
+static bool log_limit(const char *fmt,const char *msg)
 {
-	struct stat t;
-	return !stat(path,&t);
-}
+	size_t entry = tLogEntry;
+	bool limited = false;
+	pthread_mutex_lock(&gLog.lock);
 
-/*
- *	NOTE: Assuming that the file exists
- */
-static time_t get_last_time(const char *path)
-{
-	struct stat t;
+	Log_Counter *counter = NULL;
+	for (size_t i = 0;i < gLog.counterNum;i++) {
+		if (gLog.counters[i].fmt == fmt &&
+		    gLog.counters[i].entry == entry) {
+			counter = &gLog.counters[i];
+			break;
+		}
+	}
+
+	if (!counter && gLog.counterNum == gLog.counterCap) {
+		size_t cap = gLog.counterCap ? gLog.counterCap * 2 : 16;
+		Log_Counter *t = realloc(gLog.counters,
+					 cap * sizeof(Log_Counter));
+		if (t) {
+			gLog.counters	= t;
+			gLog.counterCap	= cap;
+		}
+	}
+	if (!counter && gLog.counterNum < gLog.counterCap) {
+		counter		= &gLog.counters[gLog.counterNum++];
+		counter->fmt	= fmt;
+		counter->entry	= entry;
+		counter->count	= 0;
+	}
 
-	stat(path,&t);
+	if (counter && ++counter->count > LOG_BURST) {
+		strcpy(counter->last,msg);
+		limited = true;
+	}
 
-	time_t lastChange = t.st_atim.tv_sec > t.st_mtim.tv_sec ?
-					t.st_atim.tv_sec : t.st_mtim.tv_sec;
-	return lastChange > t.st_ctim.tv_sec ? lastChange : t.st_ctim.tv_sec;
+	pthread_mutex_unlock(&gLog.lock);
+	return limited;
 }
 
-static int is_directory(const char *path)
+// err is zero if there is no reason to append. errno is preserved.
+static int log_print(int level,int err,const char *fmt,...)
 {
-	struct stat t;
+	int saved = errno;
+	Metrics *m = level <= LOG_WARNING && err ? metrics_get() : NULL;
+	if (m)
+		m->errors[err < METRICS_ERRNO_NUM ? err : 0]++;
 
-	if (stat(path,&t)) {
-		log_warn("Cannot get the status of file %s",path);
+	if (level > gLog.level) {
+		errno = saved;
 		return 0;
 	}
 
-	return S_ISDIR(t.st_mode);
+	char msg[LOG_LINE_SIZE];
+	va_list ap;
+	va_start(ap,fmt);
+	int len = vsnprintf(msg,sizeof(msg),fmt,ap);
+	va_end(ap);
+	if (len < 0) {
+		errno = saved;
+		return 0;
+	}
+	if ((size_t)len >= sizeof(msg))
+		len = sizeof(msg) - 1;
+	if (len && msg[len - 1] == '\n')
+		msg[--len] = '\0';
+
+	if (err)
+		snprintf(msg + len,sizeof(msg) - len,": %s",strerror(err));
+
+	if (level != LOG_WARNING || !log_limit(fmt,msg))
+		log_write(level,msg);
+	errno = saved;
+	return 0;
 }
 
-static void iterate_directory_sub(const char *path,
-				  void (*callback)(const char *path,void *ctx),
-				  void *ctx,bool r,bool top)
-{
-	DIR *root = opendir(path);
-	if (!root) {
-		log_warn("Cannot open directory %s\n",path);
-		return;
-	}
-	chdir(path);
+#define log_error(...) log_print(LOG_ERR,0,__VA_ARGS__)
+#define log_warn(...)  log_print(LOG_WARNING,0,__VA_ARGS__)
+#define log_info(...)  ((void)log_print(LOG_INFO,0,__VA_ARGS__))
+#define log_errno(level,err,...) log_print(level,err,__VA_ARGS__)
+#define check(assertion,...) do {					\
+	if (!(assertion)) {						\
+		log_error(__VA_ARGS__);					\
+		exit(-1);						\
+	} } while(0)
+// For failed calls,with errno as the reason
+#define check_errno(assertion,...) do {					\
+	if (!(assertion)) {						\
+		log_errno(LOG_ERR,errno,__VA_ARGS__);			\
+		exit(-1);						\
+	} } while(0)
+#define checkl(cond,log,...) ((void)(cond ? 0 : log_warn(log,__VA_ARGS__)))
 
-	for (struct dirent *dir = readdir(root);dir;dir = readdir(root)) {
-		if (dir->d_name[0] == '.')
+/*
+ *	Summarize warnings limited when running the entry,where describes
+ *	it. The others are summarized by log_flush().
+ */
+static void log_summary(size_t entry,const char *where)
+{
+	pthread_mutex_lock(&gLog.lock);
+	for (size_t i = 0;i < gLog.counterNum;) {
+		Log_Counter *counter = &gLog.counters[i];
+		if (counter->entry != entry) {
+			i++;
 			continue;
+		}
 
-		if (is_directory(dir->d_name) && r) {
-			iterate_directory_sub(dir->d_name,callback,
-					      ctx,true,false);
-		} else {
-			callback(dir->d_name,ctx);
+		if (counter->count > LOG_BURST) {
+			char msg[LOG_LINE_SIZE * 2];
+			snprintf(msg,sizeof(msg),
+				 "%s%s%ld more messages like this suppressed,"
+				 "the last: %s",where ? where : "",
+				 where ? ": " : "",counter->count - LOG_BURST,
+				 counter->last);
+			log_write(LOG_WARNING,msg);
 		}
+		*counter = gLog.counters[--gLog.counterNum];
 	}
+	pthread_mutex_unlock(&gLog.lock);
+	return;
+}
 
-	closedir(root);
-	chdir("..");
-
-	if (!top)
-		callback(path,ctx);
-
+static void log_flush(void)
+{
+	log_summary(0,NULL);
+	fflush(gLogStream);
 	return;
 }
 
-static void iterate_directory(const char *path,
-			      void (*callback)(const char *path,void *ctx),
-			      void *ctx,bool r)
+static void log_set_target(const char *target)
 {
-	iterate_directory_sub(path,callback,ctx,r,true);
+	if (!strcmp(target,"syslog")) {
+		openlog("pawprint",LOG_PID | LOG_NDELAY,LOG_DAEMON);
+		gLog.target = LOG_TARGET_SYSLOG;
+	} else if (!strcmp(target,"journal")) {
+		struct sockaddr_un addr = {
+				.sun_family	= AF_UNIX,
+				.sun_path	= "/run/systemd/journal/socket",
+			};
+		int fd = socket(AF_UNIX,SOCK_DGRAM | SOCK_CLOEXEC,0);
+		if (fd < 0 || connect(fd,(struct sockaddr *)&addr,
+				      sizeof(addr))) {
+			log_errno(LOG_WARNING,errno,
+				  "Cannot connect to the journal\n");
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		gLog.journalFd	= fd;
+		gLog.target	= LOG_TARGET_JOURNAL;
+	} else {
+		check(!strcmp(target,"stream"),"Invalid log target %s\n",
+		      target);
+		gLog.target = LOG_TARGET_STREAM;
+	}
+	return;
 }
 
-static void glob_match(const char *pattern,
-		       void (*callback)(const char *path,void *ctx),
-		       void *ctx)
+static void log_close(void)
 {
-	glob_t buf;
+	log_flush();
+	if (gLogStream != stderr)
+		fclose(gLogStream);
+	if (gLog.journalFd >= 0)
+		close(gLog.journalFd);
+	if (gLog.target == LOG_TARGET_SYSLOG)
+		closelog();
+	free(gLog.counters);
+	return;
+}
 
-	if (glob(pattern,GLOB_NOSORT,NULL,&buf)) {
-		return;
-	}
+/*
+ *	Statistics (--stats)
+ *	System calls are counted globally and for the entry of the
+ *	configuration being executed. tEntryStats is set by plan_execute()
+ *	and inherited by walking tasks,so calls made by other threads are
+ *	counted for the right entry.
+ */
+enum {
+	STAT_STAT,
+	STAT_OPEN,
+	STAT_MKDIR,
+	STAT_UNLINK,
+	STAT_CHMOD,
+	STAT_CHOWN,
+	STAT_IOCTL,
+	STAT_WRITTEN,			// Bytes written
+	STAT_NUM,
+};
+
+static const char *gStatNames[STAT_NUM] = {
+		[STAT_STAT]	= "stat",
+		[STAT_OPEN]	= "open",
+		[STAT_MKDIR]	= "mkdir",
+		[STAT_UNLINK]	= "unlink",
+		[STAT_CHMOD]	= "chmod",
+		[STAT_CHOWN]	= "chown",
+		[STAT_IOCTL]	= "ioctl",
+		[STAT_WRITTEN]	= "bytes_written",
+	};
 
-	for (size_t i = 0;i < buf.gl_pathc;i++)
-		callback(buf.gl_pathv[i],ctx);
+typedef struct {
+	atomic_long counts[STAT_NUM];
+	uint64_t timeNs;
+} Entry_Stats;
+
+#define HANDLER_NUM		32
+
+static struct {
+	atomic_long counts[STAT_NUM];
+	atomic_long handlerCalls[HANDLER_NUM];
+	atomic_ullong handlerNs[HANDLER_NUM];
+	uint64_t parseNs,executeNs;
+	atomic_ullong globNs;		// Expanding patterns only
+	Entry_Stats *entries;
+} gStats;
 
-	globfree(&buf);
+static _Thread_local Entry_Stats *tEntryStats;
 
+static void stats_add(int kind,long int num)
+{
+	atomic_fetch_add_explicit(&gStats.counts[kind],num,
+				  memory_order_relaxed);
+	if (tEntryStats)
+		atomic_fetch_add_explicit(&tEntryStats->counts[kind],num,
+					  memory_order_relaxed);
 	return;
 }
 
-#define def_handler(name) static void name (const char *path,const char *mode,\
-					    const char *userName,	      \
-					    const char *grpName,	      \
-					    const char *age,const char *arg)
-#define handler_ignore (void)path;(void)mode;(void)userName;(void)grpName;    \
-		       (void)age;(void)arg;
+#define stats_count(kind,num) do {					\
+	if (gArg.stats)							\
+		stats_add(kind,num);					\
+	} while (0)
 
-static time_t convert_age(const char *s)
+/*
+ *	Dry run (--dry-run,--estimate)
+ *	Changes are counted (and printed without --estimate) at the point
+ *	they would be made instead,everything is read as usual. System calls
+ *	are counted as if they were made,as an estimation for a real run.
+ */
+enum {
+	DRY_CREATE,
+	DRY_WRITE,
+	DRY_CHMOD,
+	DRY_CHOWN,
+	DRY_ATTR,
+	DRY_REMOVE,
+	DRY_NUM,
+};
+
+static const char *gDryNames[DRY_NUM] = {
+		[DRY_CREATE]	= "create",
+		[DRY_WRITE]	= "write",
+		[DRY_CHMOD]	= "chmod",
+		[DRY_CHOWN]	= "chown",
+		[DRY_ATTR]	= "attr",
+		[DRY_REMOVE]	= "remove",
+	};
+
+static struct {
+	atomic_long counts[DRY_NUM];
+	atomic_ullong reclaimed;	// Allocated size of removed files
+} gDryRun;
+
+// Returns true if the change must not be made
+static bool dry_run(int action,const char *path,uint64_t bytes)
 {
-	if (!s[0] || s[0] == '-') 		// Skip
-		return (time_t)-1;
+	if (!gArg.dryRun)
+		return false;
 
-	time_t t = 0;
-	for (time_t scale = strtol(s,(char **)&s,0);
-	     *s;scale = strtol(s,(char **)&s,0)) {
-		time_t unit = *s == 'd' ? 86400		:
-			      *s == 'w' ? 604800	:
-			      *s == 'h' ? 3600		:
-			      *s == 'm' ? 60		:
-			      *s == 's' ? 1		:
-					  0;
-		if (!unit)
-			return (time_t)-1;
-		t += unit * scale;
-		s++;
-	}
+	atomic_fetch_add(&gDryRun.counts[action],1);
+	atomic_fetch_add(&gDryRun.reclaimed,bytes);
+	if (!gArg.estimate)
+		printf("%s %s\n",gDryNames[action],path);
+	return true;
+}
 
-	return t;
+static uint64_t monotonic_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
 }
 
-inline static int is_excluded(const char *path)
+static char *skip_space(const char *p)
 {
-	for (int i = 0;i < gArg.excludedCount - 1;i++) {
-		if (!fnmatch(gArg.excludedList[i],path,0))
-			return 1;
+	while ((*p == ' ' || *p == '\t') && *p)
+		p++;
+	return (char*)p;
+}
+
+static time_t get_last_time(const struct stat *t)
+{
+	time_t lastChange = t->st_atim.tv_sec > t->st_mtim.tv_sec ?
+					t->st_atim.tv_sec : t->st_mtim.tv_sec;
+	return lastChange > t->st_ctim.tv_sec ? lastChange : t->st_ctim.tv_sec;
+}
+
+/*
+ *	Like strcmp(),but '/' sorts before any other character,so a
+ *	directory is directly followed by everything inside it
+ */
+static int path_cmp(const char *a,const char *b)
+{
+	while (*a && *a == *b) {
+		a++;
+		b++;
 	}
-	return 0;
+
+	unsigned char ca = *a == '/' ? 1 : *a,cb = *b == '/' ? 1 : *b;
+	return ca - cb;
 }
 
-static void clean_file(const char *path,void *ctx)
+static unsigned int hash_string(const char *s)
 {
-	if (is_excluded(path))
-		return;
+	uint32_t h = 2166136261u;		// FNV-1a
+	for (;*s;s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
 
-	time_t ddl = *(time_t*)ctx;
-	if (get_last_time(path) < ddl || gArg.clean) {
-		if (remove(path))
-			log_warn("Cannot remove file %s\n",path);
+// errno is set if false is returned
+static bool write_all(int fd,const void *buf,size_t size)
+{
+	for (const char *p = buf;size;) {
+		ssize_t ret = write(fd,p,size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (!ret)
+			errno = EIO;
+		if (ret <= 0)
+			return false;
+		p	+= ret;
+		size	-= ret;
 	}
-	return;
+	return true;
 }
 
-def_handler(attr_clean)
+static int is_directory(const char *path)
 {
-	handler_ignore;
+	struct stat t;
 
-	if (!gArg.clean)
-		return;
+	stats_count(STAT_STAT,1);
+	if (stat(path,&t)) {
+		log_errno(LOG_WARNING,errno,
+			  "Cannot get the status of file %s\n",path);
+		return 0;
+	}
+
+	return S_ISDIR(t.st_mode);
+}
 
-	time_t ddl = time(NULL) - convert_age(age);
-	iterate_directory(path,clean_file,&ddl,true);
+/*
+ *	Memory limit (--max-memory)
+ *	Memory of the arena,the plan,the age index and walked directories is
+ *	accounted,and the run fails instead of going beyond the limit.
+ */
+static struct {
+	atomic_size_t used;
+	size_t limit;			// 0 if not limited
+} gMemory;
 
+static void memory_charge(size_t size)
+{
+	size_t used = atomic_fetch_add(&gMemory.used,size) + size;
+	check(!gMemory.limit || used <= gMemory.limit,
+	      "Memory limit of %zu bytes exceeded\n",gMemory.limit);
 	return;
 }
 
-def_handler(attr_createdir)
+static void memory_uncharge(size_t size)
 {
-	handler_ignore;
-
-	if (!gArg.create)
-		return;
-
-	if (!is_valid_file(path)) {
-		if (mkdir(path,0755))
-			log_warn("Cannot create directory %s\n",path);
-	}
+	atomic_fetch_sub(&gMemory.used,size);
 	return;
 }
 
-def_handler(attr_create)
+/*
+ *	Arena allocator
+ *	Memory is allocated in blocks and released all at once. gArena holds
+ *	everything living for the whole run: configuration,the plan strings
+ *	and the exclusion trie. It is only used before executing the plan,
+ *	so there is no locking.
+ */
+#define ARENA_BLOCK_SIZE	65536
+
+typedef struct Arena_Block {
+	struct Arena_Block *next;
+	size_t used,size;
+	max_align_t data[];
+} Arena_Block;
+
+typedef struct {
+	Arena_Block *head;
+} Arena;
+
+static Arena gArena;
+
+static void *arena_alloc(Arena *arena,size_t size)
 {
-	handler_ignore;
-	if (!gArg.create)
-		return;
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
 
-	if (!is_valid_file(path)) {
-		int fd = open(path,O_CREAT | O_WRONLY);
-		if (fd < 0) {
-			log_warn("Cannot create file %s\n",path);
-			return;
-		}
-		close(fd);
+	Arena_Block *block = arena->head;
+	if (!block || block->size - block->used < size) {
+		size_t blockSize = size > ARENA_BLOCK_SIZE ? size :
+							     ARENA_BLOCK_SIZE;
+		memory_charge(sizeof(Arena_Block) + blockSize);
+		block = malloc(sizeof(Arena_Block) + blockSize);
+		check(block,"Cannot allocate memory\n");
+		block->size	= blockSize;
+		block->used	= 0;
+		block->next	= arena->head;
+		arena->head	= block;
 	}
-	return;
+
+	void *p = (char*)block->data + block->used;
+	block->used += size;
+	return p;
 }
 
-def_handler(attr_perm)
+static char *arena_strdup(Arena *arena,const char *s)
 {
-	handler_ignore;
-
-	if (mode[0] == '-' || !mode[0])		// Simply ignore
-		return;
+	size_t length = strlen(s) + 1;
+	return memcpy(arena_alloc(arena,length),s,length);
+}
 
-	if (chmod(path,(mode_t)strtol(mode,NULL,8)))
-		log_warn("Cannot set file mode as %s for %s\n",mode,path);
+/*
+ *	Grow an array allocated from the arena,whose capacity is the smallest
+ *	power of two not less than num (at least 4)
+ */
+static void *arena_grow(Arena *arena,void *array,size_t num,size_t size)
+{
+	if (num && (num < 4 || (num & (num - 1))))
+		return array;
 
-	return;
+	void *p = arena_alloc(arena,(num ? num * 2 : 4) * size);
+	return num ? memcpy(p,array,num * size) : p;
 }
 
-static void adjust_user(const char *path,const char *user)
+static void arena_free(Arena *arena)
 {
-	if (user[0] == '-' || !user[0])		// Ignore
-		return;
-
-	struct passwd *pswd = getpwnam(user);
-	if (!pswd) {
-		log_warn("Invalid user %s\n",user);
-		return;
+	for (Arena_Block *block = arena->head,*next;block;block = next) {
+		next = block->next;
+		free(block);
 	}
-
-	if (chown(path,pswd->pw_uid,-1))
-		log_warn("Cannot transfer file %s to user %s",path,user);
+	arena->head = NULL;
 	return;
 }
 
-static void adjust_group(const char *path,const char *group)
-{
-	if (group[0] == '-' || !group[0])
-		return;
+/*
+ *	Exclusion matcher
+ *	Patterns from 'x' lines are compiled into a trie of path components.
+ *	Literal patterns are matched by walking the trie only,patterns with
+ *	wildcards are attached to the node of their literal prefix and
+ *	checked with fnmatch() when a path passes by that node.
+ *	An excluded path excludes everything below it as well.
+ */
+typedef struct Exclude_Node {
+	char *name;
+	struct Exclude_Node **children;		// Sorted by name
+	size_t childNum;
+	char **globs;
+	size_t globNum;
+	bool excluded;
+} Exclude_Node;
 
-	struct group *grpInfo = getgrnam(group);
-	if (!grpInfo) {
-		log_warn("Invalid group %s\n",group);
-		return;
-	}
+static Exclude_Node gExcludeRoot;
 
-	if (chown(path,-1,grpInfo->gr_gid))
-		log_warn("Cannot transfer file %s to group %s\n",path,group);
-	return;
+static int exclude_name_cmp(const char *name,const char *comp,size_t length)
+{
+	int ret = strncmp(name,comp,length);
+	return ret ? ret : (unsigned char)name[length];
 }
 
-def_handler(attr_ownership)
+/*
+ *	Returns the index of the child,or where it should be inserted
+ */
+static size_t exclude_find(const Exclude_Node *node,const char *comp,
+			   size_t length,bool *found)
 {
-	handler_ignore;
-	adjust_user(path,userName);
-	adjust_group(path,grpName);
-	return;
+	size_t low = 0,high = node->childNum;
+	*found = false;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int ret = exclude_name_cmp(node->children[mid]->name,comp,
+					   length);
+		if (!ret) {
+			*found = true;
+			return mid;
+		}
+		if (ret < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
 }
 
-def_handler(attr_write)
+static void exclude_add(const char *pattern)
 {
-	handler_ignore;
+	Exclude_Node *node = &gExcludeRoot;
+	const char *p = pattern;
 
-	if (!gArg.create)
-		return;
+	while (true) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
 
-	if (is_valid_file(path)) {
-		int fd = open(path,O_WRONLY | O_TRUNC);
-		if (fd < 0) {
-			log_warn("Cannot open file %s\n",path);
+		size_t length = strcspn(p,"/");
+		if (strcspn(p,"*?[\\") < length) {	// Wildcard component
+			node->globs = arena_grow(&gArena,node->globs,
+						 node->globNum,sizeof(char *));
+			node->globs[node->globNum++] = arena_strdup(&gArena,
+								     pattern);
 			return;
 		}
-		ssize_t length = strlen(arg);
-		for (ssize_t s = write(fd,arg,strlen(arg));
-		     s && length;
-		     s = write(fd,arg,length)) {
-			if (s <= 0) {
-				log_warn("Cannot write to file %s\n",path);
-				close(fd);
-				return;
-			}
-			length -= s;
+
+		bool found;
+		size_t idx = exclude_find(node,p,length,&found);
+		if (!found) {
+			Exclude_Node *child = arena_alloc(&gArena,
+							  sizeof(Exclude_Node));
+			Exclude_Node **children = arena_grow(&gArena,
+						node->children,node->childNum,
+						sizeof(Exclude_Node *));
+			*child = (Exclude_Node) {
+					.name = arena_alloc(&gArena,length + 1),
+				 };
+			memcpy(child->name,p,length);
+			child->name[length] = '\0';
+
+			memmove(children + idx + 1,children + idx,
+				sizeof(Exclude_Node*) * (node->childNum - idx));
+			children[idx] = child;
+			node->children = children;
+			node->childNum++;
 		}
-		close(fd);
+
+		node = node->children[idx];
+		p += length;
 	}
+
+	node->excluded = true;
 	return;
 }
 
-static void do_remove(const char *path,void *in)
+// Without 'x' lines nothing is matched,walks need not build paths for it
+static bool exclude_empty(void)
 {
-	(void)in;
-	remove(path);
-	return;
+	return !gExcludeRoot.excluded && !gExcludeRoot.childNum &&
+	       !gExcludeRoot.globNum;
 }
 
-def_handler(attr_remove)
+static int is_excluded(const char *path)
 {
-	handler_ignore;
+	const Exclude_Node *node = &gExcludeRoot;
+	const char *p = path;
 
-	if (!gArg.remove)
-		return;
+	while (true) {
+		if (node->excluded)
+			return 1;
 
-	if (is_directory(path)) {
-		iterate_directory(path,do_remove,NULL,true);
-	} else {
-		do_remove(path,NULL);
-	}
+		for (size_t i = 0;i < node->globNum;i++) {
+			if (!fnmatch(node->globs[i],path,0))
+				return 1;
+		}
 
-	return;
-}
+		while (*p == '/')
+			p++;
+		if (!*p || !node->childNum)
+			return 0;
 
-static void do_set_file_attr(const char *path,void *in)
-{
-	const char *attr = in;
+		size_t length = strcspn(p,"/");
+		bool found;
+		size_t idx = exclude_find(node,p,length,&found);
+		if (!found)
+			return 0;
 
-	int type = 0;
-	if (attr[0] == '+') {
-		type = 1;
-	} else if (attr[0] == '-') {
-		type = 0;
-	} else {
-		log_warn("Invalid file attribute operation %c\n",attr[0]);
-		return;
+		node = node->children[idx];
+		p += length;
 	}
+}
 
+/*
+ *	An entry found by the directory walker. Callbacks should operate
+ *	on (dirFd,name) with *at() functions, path is only for matching and
+ *	logging.
+ *	st is NULL unless WALK_STAT is given or d_type is not available.
+ *	data is what the Walk_Enter hook attached to a directory,parentData
+ *	is that of the directory containing the entry. partial is set if some
+ *	entries inside the directory could not be read.
+ */
+typedef struct {
+	int dirFd;
+	const char *name;
+	const char *path;
+	const struct stat *st;
+	bool isDir;
+	bool partial;
+	void *data;
+	void *parentData;
+} Walk_Entry;
+
+typedef void (*Walk_Callback)(const Walk_Entry *entry,void *ctx);
+// Called before descending into a subdirectory,which is left out entirely
+// (not passed to the callback either) if false is returned
+typedef bool (*Walk_Enter)(const Walk_Entry *entry,void **data,void *ctx);
+
+#define WALK_RECURSIVE	s(0)		// Descend into subdirectories
+#define WALK_STAT	s(1)		// Callback needs the status of entries
+#define WALK_EXCLUDE	s(2)		// Skip excluded entries and subtrees
+#define WALK_HIDDEN	s(3)		// Include names starting with '.'
+
+/*
+ *	Work-stealing thread pool, used for parallel traversal (--jobs)
+ *	Each worker (the main thread is worker 0) owns a bounded deque. New
+ *	tasks are pushed to and popped from the tail of its own deque, while
+ *	idle workers steal from the head of others. A task is executed
+ *	inline if the pool is not started or the deque is full, so memory
+ *	usage keeps bounded.
+ */
+#define POOL_DEQUE_SIZE		256
+#define POOL_STACK_SIZE		(2 << 20)
+
+typedef struct {
+	void (*func)(void *arg);
+	void *arg;
+} Task;
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t head,tail;
+	Task tasks[POOL_DEQUE_SIZE];
+} Task_Deque;
+
+static struct {
+	int workerNum;
+	pthread_t *threads;
+	Task_Deque *deques;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	atomic_long queued;
+	atomic_int sleeping;
+	atomic_bool quit;
+} gPool = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.cond	= PTHREAD_COND_INITIALIZER,
+	  };
+
+static _Thread_local int tWorkerId;
+
+static bool pool_get(Task *task)
+{
+	Task_Deque *own = &gPool.deques[tWorkerId];
+	bool got = false;
+
+	pthread_mutex_lock(&own->lock);
+	if (own->tail != own->head) {
+		own->tail--;
+		*task = own->tasks[own->tail % POOL_DEQUE_SIZE];
+		got = true;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	for (int i = 1;!got && i < gPool.workerNum;i++) {
+		Task_Deque *victim = &gPool.deques[(tWorkerId + i) %
+						   gPool.workerNum];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->tail != victim->head) {
+			*task = victim->tasks[victim->head % POOL_DEQUE_SIZE];
+			victim->head++;
+			got = true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	if (got)
+		atomic_fetch_sub(&gPool.queued,1);
+	return got;
+}
+
+static void pool_wakeup(void)
+{
+	pthread_mutex_lock(&gPool.lock);
+	pthread_cond_broadcast(&gPool.cond);
+	pthread_mutex_unlock(&gPool.lock);
+	return;
+}
+
+/*
+ *	Sleep until there may be something to do. A submitter increases
+ *	queued before checking sleeping,so no wakeup is lost.
+ */
+static void pool_sleep(const atomic_bool *done)
+{
+	pthread_mutex_lock(&gPool.lock);
+	atomic_fetch_add(&gPool.sleeping,1);
+	if (!atomic_load(&gPool.queued) && !atomic_load(&gPool.quit) &&
+	    !(done && atomic_load(done)))
+		pthread_cond_wait(&gPool.cond,&gPool.lock);
+	atomic_fetch_sub(&gPool.sleeping,1);
+	pthread_mutex_unlock(&gPool.lock);
+	return;
+}
+
+static void pool_submit(void (*func)(void *arg),void *arg)
+{
+	if (!gPool.workerNum) {
+		func(arg);
+		return;
+	}
+
+	Task_Deque *own = &gPool.deques[tWorkerId];
+	bool pushed = false;
+
+	pthread_mutex_lock(&own->lock);
+	if (own->tail - own->head < POOL_DEQUE_SIZE) {
+		own->tasks[own->tail % POOL_DEQUE_SIZE] = (Task) {
+								.func	= func,
+								.arg	= arg,
+							   };
+		own->tail++;
+		pushed = true;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	if (!pushed) {
+		func(arg);
+		return;
+	}
+
+	atomic_fetch_add(&gPool.queued,1);
+	if (atomic_load(&gPool.sleeping))
+		pool_wakeup();
+	return;
+}
+
+/*
+ *	Help executing tasks until *done is set
+ */
+static void pool_wait(const atomic_bool *done)
+{
+	Task task;
+	while (!atomic_load(done)) {
+		if (gPool.workerNum && pool_get(&task))
+			task.func(task.arg);
+		else if (!atomic_load(done))
+			pool_sleep(done);
+	}
+	return;
+}
+
+static void *pool_worker(void *arg)
+{
+	tWorkerId = (int)(intptr_t)arg;
+
+	Task task;
+	while (!atomic_load(&gPool.quit)) {
+		if (pool_get(&task))
+			task.func(task.arg);
+		else
+			pool_sleep(NULL);
+	}
+
+	return NULL;
+}
+
+static void pool_start(int workerNum)
+{
+	if (workerNum <= 1)
+		return;
+
+	// Every queued directory may hold a descriptor
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE,&limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE,&limit);
+	}
+
+	gPool.deques	= malloc(sizeof(Task_Deque) * workerNum);
+	gPool.threads	= malloc(sizeof(pthread_t) * workerNum);
+	check(gPool.deques && gPool.threads,
+	      "Cannot allocate memory for thread pool\n");
+
+	for (int i = 0;i < workerNum;i++) {
+		pthread_mutex_init(&gPool.deques[i].lock,NULL);
+		gPool.deques[i].head = gPool.deques[i].tail = 0;
+	}
+	gPool.workerNum = workerNum;
+	atomic_store(&gPool.quit,false);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr,POOL_STACK_SIZE);
+	for (int i = 1;i < workerNum;i++) {
+		int ret = pthread_create(&gPool.threads[i],&attr,pool_worker,
+					 (void*)(intptr_t)i);
+		if (ret) {
+			log_errno(LOG_WARNING,ret,"Cannot create worker thread,"
+				  "running with %d jobs\n",i);
+			gPool.workerNum = i;
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	if (gPool.workerNum == 1)
+		gPool.workerNum = 0;
+	return;
+}
+
+static void pool_stop(void)
+{
+	if (!gPool.workerNum)
+		return;
+
+	atomic_store(&gPool.quit,true);
+	pool_wakeup();
+	for (int i = 1;i < gPool.workerNum;i++)
+		pthread_join(gPool.threads[i],NULL);
+
+	free(gPool.threads);
+	free(gPool.deques);
+	gPool.workerNum = 0;
+	return;
+}
+
+/*
+ *	Filesystem profiles
+ *	The filesystem of each entry is detected with statfs() in
+ *	process_file() (cached by device),and handlers and walks of the entry
+ *	take the shortcuts of its profile. Unchanged modes,ownerships,
+ *	attributes and contents are never set again on any filesystem,which
+ *	also saves copy-ups on overlayfs.
+ */
+typedef struct {
+	const char *name;
+	unsigned long int magic;
+	unsigned long int attrFlags;	// Attributes supported,0 for any
+	bool subvol;			// Directories may be subvolumes
+	bool ioBatch;			// Queue walked entries to io_uring
+} Fs_Profile;
+
+static const Fs_Profile gFsProfiles[] = {
+		{ .name = "generic" },
+		{
+			.name		= "tmpfs",
+			.magic		= TMPFS_MAGIC,
+			.attrFlags	= FS_APPEND_FL | FS_IMMUTABLE_FL |
+					  FS_NODUMP_FL | FS_NOATIME_FL,
+		},
+		{
+			.name		= "btrfs",
+			.magic		= BTRFS_SUPER_MAGIC,
+			.subvol		= true,
+		},
+		{
+			// Requests are issued in parallel by io-wq workers
+			.name		= "nfs",
+			.magic		= NFS_SUPER_MAGIC,
+			.ioBatch	= true,
+		},
+	};
+
+#define FS_CACHE_SIZE		16
+
+static struct {
+	dev_t devs[FS_CACHE_SIZE];
+	const Fs_Profile *profiles[FS_CACHE_SIZE];
+	size_t num;
+	pthread_mutex_t lock;
+} gFsCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Profile of the entry being processed,inherited by walking tasks
+static _Thread_local const Fs_Profile *tFsProfile;
+
+/*
+ *	I/O backend
+ *	Removals and status queries of walked entries go through io_*(). With
+ *	--io-uring,they are queued per thread and submitted to an io_uring in
+ *	batches,otherwise (or if the kernel does not support it) plain POSIX
+ *	calls are issued. Queued requests are flushed when the queue is full,
+ *	before a directory is removed or closed and after each entry of the
+ *	configuration.
+ */
+#define IO_BATCH_SIZE		256
+
+#ifdef HAVE_IO_URING
+
+enum {
+	IO_OP_STATX,
+	IO_OP_UNLINK,
+};
+
+typedef struct {
+	int op;
+	int dirFd,flags;
+	const char *name;	// For IO_OP_UNLINK,offsets in strBuf are used
+	size_t pathOff,nameOff;
+	int *result;
+} Io_Request;
+
+typedef struct {
+	int fd;
+	void *sqMap,*cqMap;			// cqMap may be sqMap
+	size_t sqSize,cqSize,sqesSize;
+	unsigned int *sqHead,*sqTail,sqMask,*sqArray;
+	unsigned int *cqHead,*cqTail,cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	size_t count;
+	Io_Request reqs[IO_BATCH_SIZE];
+	struct statx stx[IO_BATCH_SIZE];
+	char *strBuf;
+	size_t strLen,strCap;
+} Io_Queue;
+
+/*
+ *	Queues of workers are freed by the key when they exit,the one of the
+ *	main thread by io_release()
+ */
+static _Thread_local Io_Queue *tIoQueue;
+static pthread_key_t gIoQueueKey;
+static pthread_once_t gIoQueueOnce = PTHREAD_ONCE_INIT;
+static atomic_bool gIoUringBroken;
+
+// Unmaps and closes what io_ring_setup() got,then frees q
+static void io_queue_free(void *arg)
+{
+	Io_Queue *q = arg;
+	if (q->sqMap && q->sqMap != MAP_FAILED)
+		munmap(q->sqMap,q->sqSize);
+	if (q->cqMap && q->cqMap != MAP_FAILED && q->cqMap != q->sqMap)
+		munmap(q->cqMap,q->cqSize);
+	if (q->sqes && q->sqes != MAP_FAILED)
+		munmap(q->sqes,q->sqesSize);
+	if (q->fd >= 0)
+		close(q->fd);
+	free(q->strBuf);
+	free(q);
+	return;
+}
+
+static void io_queue_key_create(void)
+{
+	check(!pthread_key_create(&gIoQueueKey,io_queue_free),
+	      "Cannot create key for I/O queues\n");
+	return;
+}
+
+static int io_ring_setup(Io_Queue *q)
+{
+	struct io_uring_params param;
+	memset(&param,0,sizeof(param));
+
+	q->fd = syscall(__NR_io_uring_setup,IO_BATCH_SIZE,&param);
+	if (q->fd < 0)
+		return -1;
+
+	size_t sqSize = param.sq_off.array +
+			param.sq_entries * sizeof(unsigned int);
+	size_t cqSize = param.cq_off.cqes +
+			param.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = param.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+
+	char *sq = mmap(NULL,sqSize,PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,q->fd,IORING_OFF_SQ_RING);
+	char *cq = single ? sq :
+			    mmap(NULL,cqSize,PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE,q->fd,
+				 IORING_OFF_CQ_RING);
+	q->sqesSize = param.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(NULL,q->sqesSize,PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE,q->fd,IORING_OFF_SQES);
+	q->sqMap	= sq;
+	q->sqSize	= sqSize;
+	q->cqMap	= cq;
+	q->cqSize	= cqSize;
+	if (sq == MAP_FAILED || cq == MAP_FAILED || q->sqes == MAP_FAILED)
+		return -1;
+
+	q->sqHead	= (unsigned int*)(sq + param.sq_off.head);
+	q->sqTail	= (unsigned int*)(sq + param.sq_off.tail);
+	q->sqMask	= *(unsigned int*)(sq + param.sq_off.ring_mask);
+	q->sqArray	= (unsigned int*)(sq + param.sq_off.array);
+	q->cqHead	= (unsigned int*)(cq + param.cq_off.head);
+	q->cqTail	= (unsigned int*)(cq + param.cq_off.tail);
+	q->cqMask	= *(unsigned int*)(cq + param.cq_off.ring_mask);
+	q->cqes		= (struct io_uring_cqe*)(cq + param.cq_off.cqes);
+
+	// Both IORING_OP_STATX and IORING_OP_UNLINKAT are required
+	size_t probeSize = sizeof(struct io_uring_probe) +
+			   256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1,probeSize);
+	int ok = probe &&
+		 syscall(__NR_io_uring_register,q->fd,IORING_REGISTER_PROBE,
+			 probe,256) >= 0 &&
+		 probe->last_op >= IORING_OP_UNLINKAT &&
+		 (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+		 (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok ? 0 : -1;
+}
+
+static Io_Queue *io_queue_get(void)
+{
+	bool enabled = gArg.ioUring || (tFsProfile && tFsProfile->ioBatch);
+	if (!enabled || tIoQueue || atomic_load(&gIoUringBroken))
+		return tIoQueue;
+
+	Io_Queue *q = calloc(1,sizeof(Io_Queue));
+	check(q,"Cannot allocate memory for I/O queue\n");
+
+	if (io_ring_setup(q)) {
+		if (!atomic_exchange(&gIoUringBroken,true))
+			log_warn("io_uring is not supported,"
+				 "fall back to POSIX calls\n");
+		io_queue_free(q);
+		return NULL;
+	}
+
+	pthread_once(&gIoQueueOnce,io_queue_key_create);
+	pthread_setspecific(gIoQueueKey,q);
+	tIoQueue = q;
+	return q;
+}
+
+static void io_flush(void)
+{
+	Io_Queue *q = tIoQueue;
+	if (!q || !q->count)
+		return;
+
+	unsigned int tail = *q->sqTail;
+	for (size_t i = 0;i < q->count;i++) {
+		Io_Request *req = &q->reqs[i];
+		unsigned int idx = tail & q->sqMask;
+		struct io_uring_sqe *sqe = &q->sqes[idx];
+
+		memset(sqe,0,sizeof(*sqe));
+		sqe->fd		= req->dirFd;
+		sqe->user_data	= i;
+		if (req->op == IO_OP_STATX) {
+			sqe->opcode	= IORING_OP_STATX;
+			sqe->addr	= (uintptr_t)req->name;
+			sqe->len	= STATX_BASIC_STATS;
+			sqe->off	= (uintptr_t)&q->stx[i];
+			sqe->statx_flags = req->flags;
+		} else {
+			sqe->opcode	= IORING_OP_UNLINKAT;
+			sqe->addr	= (uintptr_t)(q->strBuf + req->nameOff);
+			sqe->unlink_flags = req->flags;
+		}
+
+		q->sqArray[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(q->sqTail,tail,__ATOMIC_RELEASE);
+
+	size_t done = 0;
+	unsigned int toSubmit = q->count;
+	while (done < q->count) {
+		int ret = syscall(__NR_io_uring_enter,q->fd,toSubmit,1,
+				  IORING_ENTER_GETEVENTS,NULL,0);
+		if (ret < 0) {
+			check_errno(errno == EINTR || errno == EAGAIN,
+				    "Cannot submit I/O requests\n");
+			continue;
+		}
+		toSubmit -= ret;
+
+		unsigned int head = *q->cqHead;
+		while (head != __atomic_load_n(q->cqTail,__ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &q->cqes[head & q->cqMask];
+			Io_Request *req = &q->reqs[cqe->user_data];
+
+			if (req->op == IO_OP_STATX) {
+				*req->result = cqe->res;
+			} else if (cqe->res < 0) {
+				log_errno(LOG_WARNING,-cqe->res,
+					  "Cannot remove file %s\n",
+					  q->strBuf + req->pathOff);
+				atomic_fetch_add(&gCounter.failedRemovals,1);
+			} else if (metrics_get()) {
+				tMetrics->removed++;
+			}
+
+			head++;
+			done++;
+		}
+		__atomic_store_n(q->cqHead,head,__ATOMIC_RELEASE);
+	}
+
+	q->count	= 0;
+	q->strLen	= 0;
+	return;
+}
+
+static void statx_to_stat(const struct statx *x,struct stat *st)
+{
+	memset(st,0,sizeof(*st));
+	st->st_dev		= makedev(x->stx_dev_major,x->stx_dev_minor);
+	st->st_ino		= x->stx_ino;
+	st->st_mode		= x->stx_mode;
+	st->st_nlink		= x->stx_nlink;
+	st->st_uid		= x->stx_uid;
+	st->st_gid		= x->stx_gid;
+	st->st_rdev		= makedev(x->stx_rdev_major,x->stx_rdev_minor);
+	st->st_size		= x->stx_size;
+	st->st_blksize		= x->stx_blksize;
+	st->st_blocks		= x->stx_blocks;
+	st->st_atim.tv_sec	= x->stx_atime.tv_sec;
+	st->st_atim.tv_nsec	= x->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec	= x->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec	= x->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec	= x->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec	= x->stx_ctime.tv_nsec;
+	return;
+}
+
+// Queued requests of the main thread must have been flushed
+static void io_release(void)
+{
+	if (tIoQueue)
+		io_queue_free(tIoQueue);
+	tIoQueue = NULL;
+	return;
+}
+
+#else
+
+static void io_flush(void)
+{
+	return;
+}
+
+static void io_release(void)
+{
+	return;
+}
+
+#endif
+
+/*
+ *	Get the status of num entries in dirFd,without following symlinks.
+ *	errs[i] is set to 0 on success,or the errno.
+ */
+static void io_stat_batch(int dirFd,size_t num,const char *const *names,
+			  struct stat *sts,int *errs)
+{
+	stats_count(STAT_STAT,num);
+#ifdef HAVE_IO_URING
+	Io_Queue *q = io_queue_get();
+	if (q && num <= IO_BATCH_SIZE) {
+		if (q->count + num > IO_BATCH_SIZE)
+			io_flush();
+
+		size_t base = q->count;
+		int res[IO_BATCH_SIZE];
+		for (size_t i = 0;i < num;i++) {
+			q->reqs[base + i] = (Io_Request) {
+					.op	= IO_OP_STATX,
+					.dirFd	= dirFd,
+					.flags	= AT_SYMLINK_NOFOLLOW,
+					.name	= names[i],
+					.result	= &res[i],
+				};
+		}
+		q->count += num;
+		io_flush();
+
+		for (size_t i = 0;i < num;i++) {
+			errs[i] = res[i] < 0 ? -res[i] : 0;
+			if (!errs[i])
+				statx_to_stat(&q->stx[base + i],&sts[i]);
+		}
+		return;
+	}
+#endif
+
+	for (size_t i = 0;i < num;i++)
+		errs[i] = fstatat(dirFd,names[i],&sts[i],AT_SYMLINK_NOFOLLOW) ?
+				errno : 0;
+	return;
+}
+
+/*
+ *	Remove name in dirFd,path is only for logging. Returns -1 with errno
+ *	set if the removal failed immediately. Queued removals report errors
+ *	to the log when completed.
+ *	Directories are always removed synchronously,after the queued
+ *	requests.
+ */
+static int io_unlinkat(int dirFd,const char *name,int flags,const char *path)
+{
+	stats_count(STAT_UNLINK,1);
+	if (gArg.dryRun) {
+		struct stat st;
+		bool freed = !fstatat(dirFd,name,&st,AT_SYMLINK_NOFOLLOW) &&
+			     (S_ISDIR(st.st_mode) || st.st_nlink == 1);
+		dry_run(DRY_REMOVE,path,freed ? st.st_blocks * 512 : 0);
+		return 0;
+	}
+#ifdef HAVE_IO_URING
+	Io_Queue *q = io_queue_get();
+	if (q && !(flags & AT_REMOVEDIR)) {
+		size_t pathLen = strlen(path) + 1,nameLen = strlen(name) + 1;
+		if (q->count == IO_BATCH_SIZE)
+			io_flush();
+
+		if (q->strLen + pathLen + nameLen > q->strCap) {
+			size_t cap = (q->strCap ? q->strCap * 2 : 16384) +
+				     pathLen + nameLen;
+			char *buf = realloc(q->strBuf,cap);
+			check(buf,"Cannot allocate memory for I/O queue\n");
+			q->strBuf = buf;
+			q->strCap = cap;
+		}
+
+		Io_Request *req = &q->reqs[q->count++];
+		*req = (Io_Request) {
+				.op		= IO_OP_UNLINK,
+				.dirFd		= dirFd,
+				.flags		= flags,
+				.pathOff	= q->strLen,
+				.nameOff	= q->strLen + pathLen,
+			};
+		memcpy(q->strBuf + q->strLen,path,pathLen);
+		memcpy(q->strBuf + q->strLen + pathLen,name,nameLen);
+		q->strLen += pathLen + nameLen;
+		return 0;
+	}
+#else
+	(void)path;
+#endif
+
+	if (flags & AT_REMOVEDIR)
+		io_flush();
+	int ret = unlinkat(dirFd,name,flags);
+	if (!ret && metrics_get())
+		tMetrics->removed++;
+	return ret;
+}
+
+static int io_mkdirat(int dirFd,const char *path,mode_t mode)
+{
+	io_flush();
+	stats_count(STAT_MKDIR,1);
+	if (dry_run(DRY_CREATE,path,0))
+		return 0;
+	return mkdirat(dirFd,path,mode);
+}
+
+// Create a regular file if it does not exist
+static int io_creat(int dirFd,const char *path,mode_t mode)
+{
+	io_flush();
+	stats_count(STAT_OPEN,1);
+	if (dry_run(DRY_CREATE,path,0))
+		return 0;
+
+	int fd = openat(dirFd,path,O_CREAT | O_WRONLY | O_CLOEXEC,mode);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+/*
+ *	Checkpoints (--checkpoint,--resume,--time-budget)
+ *	A cleaning walk keeps its directories not finished in a list. Taking
+ *	paths in order with directories directly followed by their contents
+ *	(as path_cmp()),everything before the first directory not read
+ *	completely is done,except removing directories themselves. This
+ *	cursor of each running walk,with the cleaned paths done,is saved to
+ *	the state file every CHECKPOINT_INTERVAL seconds,and when the time
+ *	budget is used up. Walks stop then,leaving directories not read yet.
+ *	With --resume,paths done are not cleaned again,and a walk skips what
+ *	is before its cursor. The file is removed when a run is completed.
+ */
+#define CHECKPOINT_MAGIC	"PAWCKPT"
+#define CHECKPOINT_VERSION	1
+#define CHECKPOINT_INTERVAL	10		// In seconds
+#define CHECKPOINT_HASH_SIZE	256
+
+typedef struct Progress_Dir {
+	struct Progress_Dir *prev,*next;
+	const char *path;		// Not terminated while being read
+	size_t pathLen;
+	bool read;
+} Progress_Dir;
+
+typedef struct Walk_Progress {
+	struct Walk_Progress *prev,*next;	// Running walks
+	const char *source,*path;
+	unsigned int line;
+	pthread_mutex_t lock;
+	Progress_Dir *dirs;			// Not finished yet
+	const char *resume;			// Cursor loaded,or NULL
+} Walk_Progress;
+
+typedef struct Checkpoint_Record {
+	struct Checkpoint_Record *next;
+	const char *source,*path;
+	unsigned int line;
+	const char *cursor;			// NULL if the path is done
+} Checkpoint_Record;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordNum;
+} Checkpoint_Header;
+
+// Followed by the source,the path and the cursor,terminated with '\0'
+typedef struct {
+	uint32_t line;
+	uint32_t done;
+	uint32_t sourceLen,pathLen,cursorLen;
+} Checkpoint_Entry;
+
+static struct {
+	const char *path;
+	bool resume;
+	uint64_t budgetNs;			// Deadline,0 if none
+	atomic_bool stopped;
+	atomic_ullong nextNs;			// Next time to save
+	pthread_mutex_t lock;
+	Walk_Progress *walks;
+	Checkpoint_Record *done;		// Paths cleaned in this run
+	Checkpoint_Record *old[CHECKPOINT_HASH_SIZE];	// Loaded by --resume
+	Checkpoint_Record *records;
+	size_t recordNum;
+	void *map;
+	size_t mapSize;
+} gCheckpoint = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// path_cmp() on strings of the given lengths
+static int progress_cmp(const char *a,size_t aLen,const char *b,size_t bLen)
+{
+	for (size_t i = 0;;i++) {
+		int ca = i < aLen ? a[i] == '/' ? 1 : (unsigned char)a[i] : 0;
+		int cb = i < bLen ? b[i] == '/' ? 1 : (unsigned char)b[i] : 0;
+		if (ca != cb || !ca)
+			return ca - cb;
+	}
+}
+
+// Whether cursor is inside the directory path
+static bool progress_inside(const char *path,size_t pathLen,const char *cursor)
+{
+	return !strncmp(cursor,path,pathLen) && cursor[pathLen] == '/';
+}
+
+/*
+ *	The first directory of the walk not read completely,NULL if there is
+ *	none. The lock should be held.
+ */
+static const Progress_Dir *progress_cursor(const Walk_Progress *progress)
+{
+	const Progress_Dir *cursor = NULL;
+	for (const Progress_Dir *dir = progress->dirs;dir;dir = dir->next) {
+		if (!dir->read && (!cursor ||
+				   progress_cmp(dir->path,dir->pathLen,
+						cursor->path,cursor->pathLen) < 0))
+			cursor = dir;
+	}
+	return cursor;
+}
+
+static bool checkpoint_add(char **buf,size_t *length,size_t *cap,
+			   const char *source,unsigned int line,
+			   const char *path,const char *cursor,
+			   size_t cursorLen)
+{
+	Checkpoint_Entry entry = {
+				.line		= line,
+				.done		= !cursor,
+				.sourceLen	= strlen(source),
+				.pathLen	= strlen(path),
+				.cursorLen	= cursor ? cursorLen : 0,
+			       };
+	size_t size = sizeof(entry) + entry.sourceLen + entry.pathLen +
+		      entry.cursorLen + 3;
+	if (*length + size > *cap) {
+		size_t newCap = (*cap ? *cap * 2 : 4096) + size;
+		char *t = realloc(*buf,newCap);
+		if (!t)
+			return false;
+		*buf = t;
+		*cap = newCap;
+	}
+
+	char *p = *buf + *length;
+	memcpy(p,&entry,sizeof(entry));
+	p += sizeof(entry);
+	memcpy(p,source,entry.sourceLen + 1);
+	p += entry.sourceLen + 1;
+	memcpy(p,path,entry.pathLen + 1);
+	p += entry.pathLen + 1;
+	if (cursor)
+		memcpy(p,cursor,cursorLen);
+	p[entry.cursorLen] = '\0';
+	*length += size;
+	return true;
+}
+
+/*
+ *	A walk without directories unread is saved as done. The cursor loaded
+ *	for a resumed walk is kept until it gets further.
+ */
+static void checkpoint_save(void)
+{
+	if (gArg.dryRun)
+		return;
+
+	pthread_mutex_lock(&gCheckpoint.lock);
+	char *buf = NULL;
+	size_t length = sizeof(Checkpoint_Header),cap = 0;
+	uint32_t num = 0;
+	bool ok = true;
+
+	for (Checkpoint_Record *r = gCheckpoint.done;ok && r;r = r->next,num++)
+		ok = checkpoint_add(&buf,&length,&cap,r->source,r->line,
+				    r->path,NULL,0);
+
+	for (Walk_Progress *w = gCheckpoint.walks;ok && w;w = w->next,num++) {
+		pthread_mutex_lock(&w->lock);
+		const Progress_Dir *dir = progress_cursor(w);
+		const char *cursor = dir ? dir->path : NULL;
+		size_t cursorLen = dir ? dir->pathLen : 0;
+		if (dir && w->resume &&
+		    progress_cmp(dir->path,dir->pathLen,w->resume,
+				 strlen(w->resume)) < 0) {
+			cursor		= w->resume;
+			cursorLen	= strlen(w->resume);
+		}
+		ok = checkpoint_add(&buf,&length,&cap,w->source,w->line,w->path,
+				    cursor,cursorLen);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (ok && !buf)
+		ok = (buf = malloc(length));
+
+	if (ok) {
+		Checkpoint_Header header = {
+					.magic		= CHECKPOINT_MAGIC,
+					.version	= CHECKPOINT_VERSION,
+					.recordNum	= num,
+				   };
+		memcpy(buf,&header,sizeof(header));
+
+		char tmpPath[PATH_MAX];
+		snprintf(tmpPath,sizeof(tmpPath),"%s.%ld",gCheckpoint.path,
+			 (long int)getpid());
+		int fd = open(tmpPath,O_WRONLY | O_CREAT | O_EXCL |
+				      O_NOFOLLOW | O_CLOEXEC,0644);
+		ok = fd >= 0 && write_all(fd,buf,length);
+		if (fd >= 0)
+			close(fd);
+		if (!ok || rename(tmpPath,gCheckpoint.path)) {
+			log_errno(LOG_WARNING,errno,
+				  "Cannot write checkpoint %s\n",
+				  gCheckpoint.path);
+			unlink(tmpPath);
+		}
+	} else {
+		log_warn("Cannot allocate memory for checkpoint\n");
+	}
+
+	pthread_mutex_unlock(&gCheckpoint.lock);
+	free(buf);
+	return;
+}
+
+/*
+ *	Save the checkpoint if it is time to. Returns true if cleaning should
+ *	stop,as the time budget is used up.
+ */
+static bool checkpoint_poll(void)
+{
+	if (atomic_load_explicit(&gCheckpoint.stopped,memory_order_relaxed))
+		return true;
+
+	uint64_t now = monotonic_ns();
+	if (gCheckpoint.budgetNs && now >= gCheckpoint.budgetNs) {
+		if (!atomic_exchange(&gCheckpoint.stopped,true)) {
+			log_info("Time budget is used up,stop cleaning\n");
+			if (gCheckpoint.path)
+				checkpoint_save();
+		}
+		return true;
+	}
+
+	unsigned long long int next = atomic_load(&gCheckpoint.nextNs);
+	if (gCheckpoint.path && now >= next &&
+	    atomic_compare_exchange_strong(&gCheckpoint.nextNs,&next,
+					   now + CHECKPOINT_INTERVAL *
+						 1000000000ull))
+		checkpoint_save();
+	return false;
+}
+
+static Checkpoint_Record *checkpoint_find(const char *source,
+					  unsigned int line,const char *path)
+{
+	unsigned int h = hash_string(path) % CHECKPOINT_HASH_SIZE;
+	for (Checkpoint_Record *r = gCheckpoint.old[h];r;r = r->next) {
+		if (r->line == line && !strcmp(r->path,path) &&
+		    !strcmp(r->source,source))
+			return r;
+	}
+	return NULL;
+}
+
+static void checkpoint_done(const char *source,unsigned int line,
+			    const char *path)
+{
+	Checkpoint_Record *r = malloc(sizeof(Checkpoint_Record) +
+				      strlen(path) + 1);
+	check(r,"Cannot allocate memory for checkpoint\n");
+	r->source	= source;
+	r->line		= line;
+	r->path		= strcpy((char *)(r + 1),path);
+	r->cursor	= NULL;
+
+	pthread_mutex_lock(&gCheckpoint.lock);
+	r->next			= gCheckpoint.done;
+	gCheckpoint.done	= r;
+	pthread_mutex_unlock(&gCheckpoint.lock);
+	return;
+}
+
+typedef struct {
+	Walk_Callback callback;
+	Walk_Enter enter;
+	void *ctx;
+	int flags;
+	atomic_bool done;
+	atomic_bool partial;
+	Entry_Stats *stats;
+	const Fs_Profile *fs;
+	size_t logEntry;
+	Walk_Progress *progress;	// NULL if not tracked
+} Walk;
+
+/*
+ *	A directory being walked. It is released after all its
+ *	subdirectories are done,then passed to the callback (post-order).
+ *	refs counts the reading of the directory itself and its unfinished
+ *	subdirectories. Its descriptor is kept until then,as children are
+ *	removed with it.
+ */
+typedef struct Walk_Dir {
+	Progress_Dir node;		// First,see walk_progress_end()
+	Walk *walk;
+	struct Walk_Dir *parent,*next;
+	atomic_int refs;
+	int fd;
+	struct stat st;
+	bool haveStat;
+	bool resuming;			// Inside it is the cursor resumed from
+	atomic_bool partial;
+	void *data;
+	const char *name;
+	size_t pathLen;
+	char path[];
+} Walk_Dir;
+
+// Leave room for the name of children
+static size_t walk_dir_size(size_t pathLen)
+{
+	return sizeof(Walk_Dir) + pathLen + NAME_MAX + 2;
+}
+
+static Walk_Dir *walk_dir_new(Walk *walk,Walk_Dir *parent,const char *path,
+			      size_t pathLen)
+{
+	memory_charge(walk_dir_size(pathLen));
+	Walk_Dir *dir = malloc(walk_dir_size(pathLen));
+	check(dir,"Cannot allocate memory for directory %s\n",path);
+
+	dir->walk	= walk;
+	dir->parent	= parent;
+	dir->fd		= -1;
+	dir->haveStat	= false;
+	dir->data	= NULL;
+	dir->pathLen	= pathLen;
+	memcpy(dir->path,path,pathLen);
+	dir->path[pathLen] = '\0';
+
+	const char *slash = strrchr(dir->path,'/');
+	dir->name	= slash ? slash + 1 : dir->path;
+	atomic_init(&dir->refs,1);
+	atomic_init(&dir->partial,false);
+	dir->resuming	= false;
+
+	Walk_Progress *progress = walk->progress;
+	if (progress) {
+		dir->node = (Progress_Dir) {
+					.path		= dir->path,
+					.pathLen	= pathLen,
+				   };
+		pthread_mutex_lock(&progress->lock);
+		dir->node.next = progress->dirs;
+		if (progress->dirs)
+			progress->dirs->prev = &dir->node;
+		progress->dirs = &dir->node;
+		pthread_mutex_unlock(&progress->lock);
+	}
+
+	return dir;
+}
+
+/*
+ *	Take a finished directory out of the progress. Once cleaning stops,
+ *	directories are kept for the checkpoint,and released by
+ *	walk_progress_end(). Returns false then.
+ */
+static bool walk_dir_finish(Walk_Dir *dir)
+{
+	Walk_Progress *progress = dir->walk->progress;
+	if (!progress)
+		return true;
+	if (atomic_load(&gCheckpoint.stopped))
+		return false;
+
+	pthread_mutex_lock(&progress->lock);
+	if (dir->node.prev)
+		dir->node.prev->next = dir->node.next;
+	else
+		progress->dirs = dir->node.next;
+	if (dir->node.next)
+		dir->node.next->prev = dir->node.prev;
+	pthread_mutex_unlock(&progress->lock);
+	return true;
+}
+
+static void walk_dir_put(Walk_Dir *dir)
+{
+	while (atomic_fetch_sub(&dir->refs,1) == 1) {
+		Walk_Dir *parent = dir->parent;
+
+		if (dir->fd >= 0)
+			close(dir->fd);
+
+		bool partial = atomic_load(&dir->partial);
+		if (!parent) {				// The top directory
+			Walk *walk = dir->walk;
+			atomic_store(&walk->partial,partial);
+			if (walk_dir_finish(dir)) {
+				memory_uncharge(walk_dir_size(dir->pathLen));
+				free(dir);
+			}
+			atomic_store(&walk->done,true);
+			if (gPool.workerNum)
+				pool_wakeup();
+			return;
+		}
+
+		Walk_Entry entry = {
+					.dirFd	= parent->fd,
+					.name	= dir->name,
+					.path	= dir->path,
+					.st	= dir->haveStat ? &dir->st : NULL,
+					.isDir	= true,
+					.partial	= partial,
+					.data		= dir->data,
+					.parentData	= parent->data,
+				   };
+		if (partial)
+			atomic_store(&parent->partial,true);
+		dir->walk->callback(&entry,dir->walk->ctx);
+
+		if (walk_dir_finish(dir)) {
+			memory_uncharge(walk_dir_size(dir->pathLen));
+			free(dir);
+		}
+		dir = parent;
+	}
+	return;
+}
+
+/*
+ *	Entries are read with getdents64 into a large buffer,and processed
+ *	in batches,so their status can be fetched at once. Subdirectories
+ *	found are submitted after the whole buffer is processed,as they may
+ *	run inline and reuse it,or after the whole directory if the walk is
+ *	tracked for checkpoints.
+ */
+#define WALK_BATCH_SIZE		IO_BATCH_SIZE
+#define WALK_DENTS_SIZE		(256 * 1024)
+
+typedef struct {
+	uint64_t ino;
+	int64_t off;
+	unsigned short int reclen;
+	unsigned char type;
+	char name[];
+} Linux_Dirent64;
+
+typedef struct {
+	_Alignas(8) char dents[WALK_DENTS_SIZE];
+	const char *names[WALK_BATCH_SIZE];
+	unsigned char types[WALK_BATCH_SIZE];
+	const char *statNames[WALK_BATCH_SIZE];
+	struct stat sts[WALK_BATCH_SIZE];
+	int errs[WALK_BATCH_SIZE];
+	int statIdx[WALK_BATCH_SIZE];
+} Walk_Batch;
+
+/*
+ *	Allocated by each thread on its first walk,freed by the key when a
+ *	worker exits and by main() for the main thread
+ */
+static _Thread_local Walk_Batch *tWalkBatch;
+static pthread_key_t gWalkBatchKey;
+static pthread_once_t gWalkBatchOnce = PTHREAD_ONCE_INIT;
+
+static void walk_batch_key_create(void)
+{
+	check(!pthread_key_create(&gWalkBatchKey,free),
+	      "Cannot create key for walking buffers\n");
+	return;
+}
+
+/*
+ *	Pass the i-th entry of batch to the callback,or add it to subs if it
+ *	is a directory to descend into
+ */
+static void walk_dir_visit(Walk_Dir *dir,Walk_Batch *batch,size_t i,
+			   Walk_Dir **subs)
+{
+	Walk *walk = dir->walk;
+	char *path = dir->path;
+	size_t pathLen = dir->pathLen;
+	const char *name = batch->names[i];
+	size_t nameLen = strlen(name);
+	path[pathLen] = '/';
+	memcpy(path + pathLen + 1,name,nameLen + 1);
+
+	// Done before the checkpoint resumed from
+	if (dir->resuming) {
+		const char *cursor = walk->progress->resume;
+		size_t length = pathLen + nameLen + 1;
+		if (progress_cmp(path,length,cursor,strlen(cursor)) < 0 &&
+		    !progress_inside(path,length,cursor)) {
+			atomic_store(&dir->partial,true);
+			return;
+		}
+	}
+
+	Walk_Entry entry = {
+				.dirFd		= dir->fd,
+				.name		= name,
+				.path		= path,
+				.st		= NULL,
+				.isDir		= batch->types[i] == DT_DIR,
+				.parentData	= dir->data,
+			   };
+
+	int idx = batch->statIdx[i];
+	if (idx >= 0) {
+		if (batch->errs[idx]) {
+			log_errno(LOG_WARNING,batch->errs[idx],
+				  "Cannot get the status of file %s\n",path);
+			atomic_store(&dir->partial,true);
+			return;
+		}
+		entry.st	= &batch->sts[idx];
+		entry.isDir	= S_ISDIR(entry.st->st_mode);
+	}
+
+	if (!entry.isDir || !(walk->flags & WALK_RECURSIVE)) {
+		walk->callback(&entry,walk->ctx);
+		return;
+	}
+
+	void *data = NULL;
+	if (walk->enter && !walk->enter(&entry,&data,walk->ctx))
+		return;
+
+	Walk_Dir *sub = walk_dir_new(walk,dir,path,pathLen + nameLen + 1);
+	sub->data = data;
+	if (entry.st) {
+		sub->st		= *entry.st;
+		sub->haveStat	= true;
+	}
+	sub->next = *subs;
+	*subs = sub;
+	atomic_fetch_add(&dir->refs,1);
+	return;
+}
+
+static int walk_dir_name_cmp(const void *pa,const void *pb)
+{
+	return strcmp((*(Walk_Dir **)pa)->name,(*(Walk_Dir **)pb)->name);
+}
+
+/*
+ *	Order subdirectories to submit by their names,so the cursor of a
+ *	checkpoint gets further. The owner of a queue takes the last task
+ *	submitted first.
+ */
+static Walk_Dir *walk_dir_sort(Walk_Dir *subs)
+{
+	size_t num = 0;
+	for (Walk_Dir *sub = subs;sub;sub = sub->next)
+		num++;
+
+	Walk_Dir **list = malloc(sizeof(Walk_Dir *) * num);
+	if (!list)
+		return subs;
+
+	num = 0;
+	for (Walk_Dir *sub = subs;sub;sub = sub->next)
+		list[num++] = sub;
+	qsort(list,num,sizeof(Walk_Dir *),walk_dir_name_cmp);
+
+	subs = NULL;
+	for (size_t i = 0;i < num;i++) {
+		Walk_Dir *sub = list[gPool.workerNum ? i : num - 1 - i];
+		sub->next	= subs;
+		subs		= sub;
+	}
+	free(list);
+	return subs;
+}
+
+static void walk_dir_task(void *arg)
+{
+	Walk_Dir *dir = arg;
+	Walk *walk = dir->walk;
+
+	Entry_Stats *savedStats = tEntryStats;
+	const Fs_Profile *savedFs = tFsProfile;
+	size_t savedLog = tLogEntry;
+	tEntryStats	= walk->stats;
+	tFsProfile	= walk->fs;
+	tLogEntry	= walk->logEntry;
+
+	Walk_Progress *progress = walk->progress;
+	bool stopped = progress && checkpoint_poll();
+	if (dir->fd < 0 && !stopped) {
+		stats_count(STAT_OPEN,1);
+		dir->fd = openat(dir->parent->fd,dir->name,
+				 O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+				 O_CLOEXEC);
+	}
+	if (dir->fd < 0 || stopped) {
+		if (!stopped)
+			log_errno(LOG_WARNING,errno,
+				  "Cannot open directory %s\n",dir->path);
+		atomic_store(&dir->partial,true);
+		walk_dir_put(dir);
+		tEntryStats	= savedStats;
+		tFsProfile	= savedFs;
+		tLogEntry	= savedLog;
+		return;
+	}
+
+	if (!tWalkBatch) {
+		tWalkBatch = malloc(sizeof(Walk_Batch));
+		check(tWalkBatch,"Cannot allocate memory for walking %s\n",
+		      dir->path);
+		pthread_once(&gWalkBatchOnce,walk_batch_key_create);
+		pthread_setspecific(gWalkBatchKey,tWalkBatch);
+	}
+	Walk_Batch *batch = tWalkBatch;
+
+	char *path = dir->path;
+	size_t pathLen = dir->pathLen;
+	dir->resuming = progress && progress->resume &&
+			progress_inside(path,pathLen,progress->resume);
+	Walk_Dir *subs = NULL;
+	for (;;) {
+		if (progress && checkpoint_poll()) {
+			stopped = true;
+			atomic_store(&dir->partial,true);
+			break;
+		}
+
+		ssize_t size = syscall(SYS_getdents64,dir->fd,batch->dents,
+				       WALK_DENTS_SIZE);
+		if (size <= 0) {
+			if (size < 0) {
+				log_errno(LOG_WARNING,errno,
+					  "Cannot read directory %s\n",path);
+				atomic_store(&dir->partial,true);
+			}
+			break;
+		}
+
+		for (ssize_t off = 0;off < size;) {
+			size_t num = 0,statNum = 0;
+			while (num < WALK_BATCH_SIZE && off < size) {
+				Linux_Dirent64 *d = (void*)(batch->dents + off);
+				off += d->reclen;
+
+				const char *name = d->name;
+				if (name[0] == '.' &&
+				    (!(walk->flags & WALK_HIDDEN) || !name[1] ||
+				     (name[1] == '.' && !name[2])))
+					continue;
+
+				size_t nameLen = strlen(name);
+				if (pathLen + nameLen + 2 > PATH_MAX) {
+					log_warn("Path %s/%s is too long\n",
+						 path,name);
+					atomic_store(&dir->partial,true);
+					continue;
+				}
+
+				if (walk->flags & WALK_EXCLUDE) {
+					path[pathLen] = '/';
+					memcpy(path + pathLen + 1,name,
+					       nameLen + 1);
+					if (is_excluded(path))
+						continue;
+				}
+
+				batch->names[num] = name;
+				batch->types[num] = d->type;
+				batch->statIdx[num] = -1;
+				if ((walk->flags & WALK_STAT) ||
+				    d->type == DT_UNKNOWN) {
+					batch->statNames[statNum] = name;
+					batch->statIdx[num] = statNum++;
+				}
+				num++;
+			}
+
+			io_stat_batch(dir->fd,statNum,batch->statNames,
+				      batch->sts,batch->errs);
+
+			for (size_t i = 0;i < num;i++)
+				walk_dir_visit(dir,batch,i,&subs);
+			path[pathLen] = '\0';
+		}
+
+		// The cursor may only pass directories read completely
+		while (subs && !progress) {
+			Walk_Dir *sub = subs;
+			subs = sub->next;
+			pool_submit(walk_dir_task,sub);
+		}
+	}
+
+	if (progress && !stopped) {
+		pthread_mutex_lock(&progress->lock);
+		dir->node.read = true;
+		pthread_mutex_unlock(&progress->lock);
+	}
+	if (progress)
+		subs = walk_dir_sort(subs);
+	while (subs) {
+		Walk_Dir *sub = subs;
+		subs = sub->next;
+		pool_submit(walk_dir_task,sub);
+	}
+
+	// Requests on dir->fd must complete before it could be closed
+	io_flush();
+	walk_dir_put(dir);
+	tEntryStats	= savedStats;
+	tFsProfile	= savedFs;
+	tLogEntry	= savedLog;
+	return;
+}
+
+// Add the walk to the checkpoint,when its top directory is in the list
+static void walk_progress_start(Walk_Progress *progress)
+{
+	pthread_mutex_lock(&gCheckpoint.lock);
+	progress->prev	= NULL;
+	progress->next	= gCheckpoint.walks;
+	if (progress->next)
+		progress->next->prev = progress;
+	gCheckpoint.walks = progress;
+	pthread_mutex_unlock(&gCheckpoint.lock);
+	return;
+}
+
+/*
+ *	Take the walk out of the checkpoint,recording its path as done unless
+ *	some directories are not read,and release directories kept
+ */
+static void walk_progress_end(Walk_Progress *progress)
+{
+	if (!progress_cursor(progress))
+		checkpoint_done(progress->source,progress->line,
+				progress->path);
+
+	pthread_mutex_lock(&gCheckpoint.lock);
+	if (progress->prev)
+		progress->prev->next = progress->next;
+	else
+		gCheckpoint.walks = progress->next;
+	if (progress->next)
+		progress->next->prev = progress->prev;
+	pthread_mutex_unlock(&gCheckpoint.lock);
+
+	for (Progress_Dir *node = progress->dirs,*next;node;node = next) {
+		next = node->next;
+		Walk_Dir *dir = (Walk_Dir *)node;
+		memory_uncharge(walk_dir_size(dir->pathLen));
+		free(dir);
+	}
+	return;
+}
+
+/*
+ *	The top directory itself is not passed to the callback,data is
+ *	attached to it. enter may be NULL. progress may be NULL,otherwise
+ *	the walk is tracked for checkpoints and stops with the time budget.
+ *	Callbacks may be called from several threads at the same time with
+ *	--jobs,they must not modify global states (e.g. the exclusion trie).
+ *	Returns -1 if some entries could not be read.
+ *	iterate_directory_at() walks the directory already opened as fd,which
+ *	is closed then,path is only used for the entries passed.
+ */
+static int iterate_directory_at(int fd,const char *path,Walk_Callback callback,
+				Walk_Enter enter,void *data,void *ctx,int flags,
+				Walk_Progress *progress)
+{
+	size_t length = strlen(path);
+	while (length > 1 && path[length - 1] == '/')
+		length--;
+	if (length >= PATH_MAX) {
+		log_warn("Path %s is too long\n",path);
+		close(fd);
+		return -1;
+	}
+
+	if (exclude_empty())
+		flags &= ~WALK_EXCLUDE;
+	Walk walk = {
+			.callback	= callback,
+			.enter		= enter,
+			.ctx		= ctx,
+			.flags		= flags,
+			.stats		= tEntryStats,
+			.fs		= tFsProfile,
+			.logEntry	= tLogEntry,
+			.progress	= progress,
+		    };
+	atomic_init(&walk.done,false);
+	atomic_init(&walk.partial,false);
+
+	// For "/",let the children be "/name" instead of "//name"
+	Walk_Dir *top = walk_dir_new(&walk,NULL,path,
+				     path[0] == '/' && length == 1 ? 0 :
+								     length);
+	top->fd		= fd;
+	top->data	= data;
+	uint64_t start = gMetrics.path ? monotonic_ns() : 0;
+	if (progress)
+		walk_progress_start(progress);
+	walk_dir_task(top);
+	pool_wait(&walk.done);
+	if (progress)
+		walk_progress_end(progress);
+	if (metrics_get())
+		tMetrics->walkNs += monotonic_ns() - start;
+
+	return atomic_load(&walk.partial) ? -1 : 0;
+}
+
+static int iterate_directory(const char *path,Walk_Callback callback,
+			     Walk_Enter enter,void *data,void *ctx,int flags,
+			     Walk_Progress *progress)
+{
+	int fd = open(path,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(LOG_WARNING,errno,"Cannot open directory %s\n",path);
+		return -1;
+	}
+
+	return iterate_directory_at(fd,path,callback,enter,data,ctx,flags,
+				    progress);
+}
+
+/*
+ *	Patterns are expanded component by component with readdir(),and
+ *	callback is called on each match as soon as it is found,so only a
+ *	directory stream per wildcard component is kept. Like glob() without
+ *	GLOB_PERIOD,a leading '.' must be matched explicitly,but "." and ".."
+ *	are never matched. Symbolic links are followed except the last
+ *	component.
+ */
+typedef struct {
+	void (*callback)(const char *path,void *ctx);
+	void *ctx;
+	bool absolute;
+	uint64_t callbackNs;
+	char path[PATH_MAX];
+} Glob_State;
+
+// Returns false if the component has any wildcard,name is unescaped
+static bool glob_literal(const char *component,size_t length,char *name)
+{
+	for (size_t i = 0;i < length;i++) {
+		if (component[i] == '\\' && i + 1 < length)
+			i++;
+		else if (strchr("*?[",component[i]))
+			return false;
+		*name++ = component[i];
+	}
+	*name = '\0';
+	return true;
+}
+
+static void glob_found(Glob_State *g,int dirFd,const char *name,
+		       bool mustDir)
+{
+	if (mustDir) {
+		struct stat st;
+		stats_count(STAT_STAT,1);
+		if (fstatat(dirFd,name,&st,0) || !S_ISDIR(st.st_mode))
+			return;
+	}
+
+	bool timed = gArg.stats || gMetrics.path;
+	uint64_t start = timed ? monotonic_ns() : 0;
+	g->callback(g->path,g->ctx);
+	if (timed)
+		g->callbackNs += monotonic_ns() - start;
+	return;
+}
+
+// Appends name to g->path,returns false if it would be too long
+static bool glob_append(Glob_State *g,size_t pathLen,const char *name)
+{
+	size_t nameLen = strlen(name);
+	bool slash = pathLen || g->absolute;
+	if (pathLen + slash + nameLen >= PATH_MAX) {
+		log_warn("Path %s/%s is too long\n",g->path,name);
+		return false;
+	}
+
+	if (slash)
+		g->path[pathLen] = '/';
+	memcpy(g->path + pathLen + slash,name,nameLen + 1);
+	return true;
+}
+
+// dirFd is closed before return
+static void glob_walk(Glob_State *g,int dirFd,size_t pathLen,
+		      const char *rest,bool mustDir)
+{
+	while (*rest == '/')
+		rest++;
+	const char *end = strchrnul(rest,'/');
+	size_t length = end - rest;
+	bool last = !*end;
+	char pattern[NAME_MAX + 1],name[NAME_MAX + 1];
+
+	if (length > NAME_MAX) {
+		close(dirFd);
+		return;
+	}
+
+	if (glob_literal(rest,length,name)) {
+		if (!glob_append(g,pathLen,name)) {
+			close(dirFd);
+			return;
+		}
+
+		if (last) {
+			struct stat st;
+			stats_count(STAT_STAT,1);
+			if (!fstatat(dirFd,name,&st,AT_SYMLINK_NOFOLLOW))
+				glob_found(g,dirFd,name,mustDir);
+		} else {
+			stats_count(STAT_OPEN,1);
+			int fd = openat(dirFd,name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd >= 0)
+				glob_walk(g,fd,strlen(g->path),end,mustDir);
+		}
+		close(dirFd);
+		return;
+	}
+
+	memcpy(pattern,rest,length);
+	pattern[length] = '\0';
+
+	DIR *stream = fdopendir(dirFd);
+	if (!stream) {
+		close(dirFd);
+		return;
+	}
+
+	struct dirent *d;
+	while ((d = readdir(stream))) {
+		if (!strcmp(d->d_name,".") || !strcmp(d->d_name,"..") ||
+		    fnmatch(pattern,d->d_name,FNM_PERIOD))
+			continue;
+
+		if (!last && d->d_type != DT_DIR && d->d_type != DT_LNK &&
+		    d->d_type != DT_UNKNOWN)
+			continue;
+
+		if (!glob_append(g,pathLen,d->d_name))
+			continue;
+
+		if (last) {
+			glob_found(g,dirfd(stream),d->d_name,mustDir);
+			continue;
+		}
+
+		stats_count(STAT_OPEN,1);
+		int fd = openat(dirfd(stream),d->d_name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0)
+			glob_walk(g,fd,strlen(g->path),end,mustDir);
+	}
+
+	closedir(stream);
+	return;
+}
+
+static void glob_match(const char *pattern,
+		       void (*callback)(const char *path,void *ctx),
+		       void *ctx)
+{
+	/*
+	 *	Most r,R,h and H lines name a single path,which matches itself
+	 *	if it exists. Slashes would be collapsed and escapes removed by
+	 *	the walk,so such paths still go through it.
+	 */
+	size_t length = strlen(pattern);
+	if (length > 1 && pattern[length - 1] != '/' &&
+	    !strpbrk(pattern,"*?[\\") && !strstr(pattern,"//")) {
+		struct stat st;
+		stats_count(STAT_STAT,1);
+		if (!lstat(pattern,&st))
+			callback(pattern,ctx);
+		return;
+	}
+
+	uint64_t start = gArg.stats || gMetrics.path ? monotonic_ns() : 0;
+
+	Glob_State *g = malloc(sizeof(Glob_State));
+	check(g,"Cannot allocate memory for expanding %s\n",pattern);
+	g->callback	= callback;
+	g->ctx		= ctx;
+	g->absolute	= pattern[0] == '/';
+	g->callbackNs	= 0;
+	g->path[0]	= '\0';
+
+	// A trailing slash matches directories only
+	bool mustDir = length && pattern[length - 1] == '/';
+	char *copy = strdup(pattern);
+	check(copy,"Cannot allocate memory for expanding %s\n",pattern);
+	while (length > 1 && copy[length - 1] == '/')
+		copy[--length] = '\0';
+
+	if (!strcmp(copy,"/")) {
+		callback(copy,ctx);
+	} else {
+		int fd = open(g->absolute ? "/" : ".",
+			      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0)
+			glob_walk(g,fd,0,copy,mustDir);
+	}
+
+	if (gArg.stats)
+		atomic_fetch_add(&gStats.globNs,monotonic_ns() - start -
+						g->callbackNs);
+	if (metrics_get())
+		tMetrics->globNs += monotonic_ns() - start - g->callbackNs;
+	free(copy);
+	free(g);
+	return;
+}
+
+/*
+ *	Status of the path being processed,shared by its handlers. It is
+ *	fetched on demand,handlers changing the type or existence of the file
+ *	should drop it.
+ */
+typedef struct {
+	struct stat st;
+	bool valid;
+	const Fs_Profile *fs;
+} File_State;
+
+static const struct stat *file_state_get(const char *path,File_State *state)
+{
+	if (!state->valid) {
+		stats_count(STAT_STAT,1);
+		state->valid = !stat(path,&state->st);
+	}
+	return state->valid ? &state->st : NULL;
+}
+
+/*
+ *	Called after creating the file. In a dry run it does not exist,so a
+ *	status that every later handler would change is made up.
+ */
+static void file_state_created(File_State *state,mode_t type)
+{
+	state->valid = gArg.dryRun;
+	if (gArg.dryRun) {
+		state->st = (struct stat) {
+					.st_mode	= type,
+					.st_uid		= (uid_t)-1,
+					.st_gid		= (gid_t)-1,
+				  };
+	}
+	return;
+}
+
+/*
+ *	Profile of the filesystem holding path,or its parent directory if it
+ *	does not exist yet
+ */
+static const Fs_Profile *fs_profile_get(const char *path,File_State *state)
+{
+	const struct stat *st = file_state_get(path,state);
+	const char *fsPath = path;
+	char parent[PATH_MAX];
+	struct stat parentSt;
+	if (!st) {
+		const char *slash = strrchr(path,'/');
+		size_t length = slash == path ? 1 : (size_t)(slash - path);
+		if (!slash || length >= sizeof(parent))
+			return &gFsProfiles[0];
+
+		memcpy(parent,path,length);
+		parent[length] = '\0';
+		stats_count(STAT_STAT,1);
+		if (stat(parent,&parentSt))
+			return &gFsProfiles[0];
+		st	= &parentSt;
+		fsPath	= parent;
+	}
+
+	const Fs_Profile *profile = NULL;
+	pthread_mutex_lock(&gFsCache.lock);
+	for (size_t i = 0;i < gFsCache.num && !profile;i++) {
+		if (gFsCache.devs[i] == st->st_dev)
+			profile = gFsCache.profiles[i];
+	}
+	pthread_mutex_unlock(&gFsCache.lock);
+	if (profile)
+		return profile;
+
+	profile = &gFsProfiles[0];
+	struct statfs fs;
+	stats_count(STAT_STAT,1);
+	if (!statfs(fsPath,&fs)) {
+		for (size_t i = 1;i < sizeof(gFsProfiles) / sizeof(Fs_Profile);
+		     i++) {
+			if (gFsProfiles[i].magic == (unsigned long int)fs.f_type)
+				profile = &gFsProfiles[i];
+		}
+	}
+
+	pthread_mutex_lock(&gFsCache.lock);
+	if (gFsCache.num < FS_CACHE_SIZE) {
+		gFsCache.devs[gFsCache.num]	= st->st_dev;
+		gFsCache.profiles[gFsCache.num]	= profile;
+		gFsCache.num++;
+	}
+	pthread_mutex_unlock(&gFsCache.lock);
+	return profile;
+}
+
+/*
+ *	Open the parent directory of path,with *name pointed to the last
+ *	component. Returns -1 if there is none.
+ */
+static int open_parent(const char *path,const char **name)
+{
+	const char *slash = strrchr(path,'/');
+	if (!slash || !slash[1])
+		return -1;
+
+	char parent[PATH_MAX];
+	size_t length = slash - path + 1;
+	if (length >= sizeof(parent))
+		return -1;
+	memcpy(parent,path,length);
+	parent[length] = '\0';
+
+	*name = slash + 1;
+	return open(parent,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ *	Fields of an entry compiled once by plan_compile(),instead of for
+ *	every file it applies to
+ */
+typedef struct {
+	mode_t mode;				// (mode_t)-1 if not given
+	uid_t uid;				// (uid_t)-1 if not given
+	gid_t gid;				// (gid_t)-1 if not given
+	time_t age;				// (time_t)-1 if not given
+	unsigned long int attrSet,attrClear;	// Types h and H
+	uint8_t handlers[HANDLER_NUM];		// Set by plan_run_entry()
+	int handlerNum;
+} Entry_Op;
+
+typedef struct {
+	Entry_Attribute attr;
+	char type;			// Type letter of the line
+	const char *modeStr,*userName,*grpName,*ageStr,*arg;
+	const char *source;		// Set by plan_compile() for checkpoints
+	unsigned int line;
+	Entry_Op op;
+} Process_File_In;
+
+#define def_handler(name) static void name (const char *path,		\
+					    const Process_File_In *in,	\
+					    File_State *state)
+#define handler_ignore (void)path;(void)in;(void)state;
+
+static time_t convert_age(const char *s)
+{
+	if (!s[0] || s[0] == '-') 		// Skip
+		return (time_t)-1;
+
+	time_t t = 0;
+	for (time_t scale = strtol(s,(char **)&s,0);
+	     *s;scale = strtol(s,(char **)&s,0)) {
+		time_t unit = *s == 'd' ? 86400		:
+			      *s == 'w' ? 604800	:
+			      *s == 'h' ? 3600		:
+			      *s == 'm' ? 60		:
+			      *s == 's' ? 1		:
+					  0;
+		if (!unit)
+			return (time_t)-1;
+		t += unit * scale;
+		s++;
+	}
+
+	return t;
+}
+
+/*
+ *	Age index (--age-index)
+ *	For each directory cleaned,the earliest last time of everything left
+ *	in its subtree is recorded with the age applied. The last time of a
+ *	file never goes back,as its ctime is updated by any change,and files
+ *	created or moved in later have a ctime after the run. So a subtree
+ *	whose earliest last time (or the time of the run) has not expired yet
+ *	could be skipped,if the directory still has the same inode,mtime and
+ *	ctime. Records of skipped subtrees are carried to the new index.
+ *	The index is dropped if exclusions have changed.
+ */
+#define AGE_INDEX_MAGIC		"PAWAGE"
+#define AGE_INDEX_VERSION	1
+
+typedef struct Age_Dir {
+	struct Age_Dir *next;
+	const char *path;
+	uint64_t dev,ino;
+	int64_t mtimeSec,mtimeNsec,ctimeSec,ctimeNsec;
+	int64_t age;
+	atomic_llong minTime;		// LLONG_MAX if nothing is left
+	bool carried,dropped;
+	bool listed;			// In gAgeIndex.list
+	int wd;				// With --watch,-1 if not watched
+	struct Age_Dir *watchNext;
+	size_t heapIdx;			// SIZE_MAX if not queued
+	int64_t deadline;		// Time to scan it again
+} Age_Dir;
+
+static struct {
+	time_t now;
+	uint64_t excludeHash;
+	Age_Dir *old;			// Sorted by path and age
+	size_t oldNum;
+	void *map;
+	size_t mapSize;
+	Age_Dir *list;			// Recorded in this run
+	size_t num;
+	pthread_mutex_t lock;
+} gAgeIndex = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ *	Watch mode (--watch)
+ *	Records of the age index are kept in memory,looked up by their inotify
+ *	watch descriptor,and queued by the time the oldest entry left in them
+ *	expires in a 4-ary min-heap. Only creations are watched: any change
+ *	updates the ctime,so it never makes anything expire earlier,and a
+ *	removal at worst makes a directory scanned before it is needed.
+ */
+#define WATCH_MASK	(IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_HEAP_ARITY	4
+
+static struct {
+	int fd;
+	Age_Dir **buckets;		// Chained by watchNext
+	size_t bucketNum,num;
+	Age_Dir **heap;
+	size_t heapNum,heapSize;
+} gWatch = { .fd = -1 };
+
+static Age_Dir **watch_bucket(int wd)
+{
+	return &gWatch.buckets[((unsigned int)wd * 2654435761u) &
+			       (gWatch.bucketNum - 1)];
+}
+
+static Age_Dir *watch_lookup(int wd,time_t age)
+{
+	if (!gWatch.num)
+		return NULL;
+
+	for (Age_Dir *dir = *watch_bucket(wd);dir;dir = dir->watchNext) {
+		if (dir->wd == wd && dir->age == age)
+			return dir;
+	}
+	return NULL;
+}
+
+static void watch_insert(Age_Dir *dir)
+{
+	if (gWatch.num >= gWatch.bucketNum) {
+		Age_Dir **old = gWatch.buckets;
+		size_t oldNum = gWatch.bucketNum;
+		gWatch.bucketNum = oldNum ? oldNum * 2 : 64;
+		gWatch.buckets = calloc(gWatch.bucketNum,sizeof(Age_Dir *));
+		check(gWatch.buckets,"Cannot allocate memory for watches\n");
+
+		for (size_t i = 0;i < oldNum;i++) {
+			while (old[i]) {
+				Age_Dir *next = old[i]->watchNext;
+				Age_Dir **bucket = watch_bucket(old[i]->wd);
+				old[i]->watchNext = *bucket;
+				*bucket = old[i];
+				old[i] = next;
+			}
+		}
+		free(old);
+	}
+
+	Age_Dir **bucket = watch_bucket(dir->wd);
+	dir->watchNext	= *bucket;
+	*bucket		= dir;
+	gWatch.num++;
+	return;
+}
+
+static void watch_heap_set(size_t i,Age_Dir *dir)
+{
+	gWatch.heap[i]	= dir;
+	dir->heapIdx	= i;
+	return;
+}
+
+static void watch_heap_up(size_t i)
+{
+	Age_Dir *dir = gWatch.heap[i];
+	while (i) {
+		size_t parent = (i - 1) / WATCH_HEAP_ARITY;
+		if (gWatch.heap[parent]->deadline <= dir->deadline)
+			break;
+		watch_heap_set(i,gWatch.heap[parent]);
+		i = parent;
+	}
+	watch_heap_set(i,dir);
+	return;
+}
+
+static void watch_heap_down(size_t i)
+{
+	Age_Dir *dir = gWatch.heap[i];
+	for (;;) {
+		size_t first = i * WATCH_HEAP_ARITY + 1,min = i;
+		int64_t minDeadline = dir->deadline;
+		for (size_t c = first;c < first + WATCH_HEAP_ARITY &&
+				      c < gWatch.heapNum;c++) {
+			if (gWatch.heap[c]->deadline < minDeadline) {
+				min		= c;
+				minDeadline	= gWatch.heap[c]->deadline;
+			}
+		}
+		if (min == i)
+			break;
+		watch_heap_set(i,gWatch.heap[min]);
+		i = min;
+	}
+	watch_heap_set(i,dir);
+	return;
+}
+
+static void watch_heap_remove(Age_Dir *dir)
+{
+	size_t i = dir->heapIdx;
+	if (i == SIZE_MAX)
+		return;
+
+	dir->heapIdx = SIZE_MAX;
+	Age_Dir *last = gWatch.heap[--gWatch.heapNum];
+	if (last != dir) {
+		watch_heap_set(i,last);
+		watch_heap_up(i);
+		watch_heap_down(last->heapIdx);
+	}
+	return;
+}
+
+static void watch_schedule(Age_Dir *dir,int64_t deadline)
+{
+	if (dir->heapIdx == SIZE_MAX) {
+		if (gWatch.heapNum == gWatch.heapSize) {
+			gWatch.heapSize = gWatch.heapSize ?
+						gWatch.heapSize * 2 : 64;
+			gWatch.heap = realloc(gWatch.heap,
+					      gWatch.heapSize * sizeof(Age_Dir *));
+			check(gWatch.heap,"Cannot allocate memory for watches\n");
+		}
+		dir->deadline = deadline;
+		watch_heap_set(gWatch.heapNum++,dir);
+		watch_heap_up(dir->heapIdx);
+		return;
+	}
+
+	int64_t old	= dir->deadline;
+	dir->deadline	= deadline;
+	if (deadline < old)
+		watch_heap_up(dir->heapIdx);
+	else
+		watch_heap_down(dir->heapIdx);
+	return;
+}
+
+static int age_dir_cmp(const void *pa,const void *pb)
+{
+	const Age_Dir *a = pa,*b = pb;
+	int ret = path_cmp(a->path,b->path);
+	return ret ? ret : a->age < b->age ? -1 : a->age > b->age;
+}
+
+static void age_dir_fill(Age_Dir *dir,const struct stat *st)
+{
+	dir->dev	= st->st_dev;
+	dir->ino	= st->st_ino;
+	dir->mtimeSec	= st->st_mtim.tv_sec;
+	dir->mtimeNsec	= st->st_mtim.tv_nsec;
+	dir->ctimeSec	= st->st_ctim.tv_sec;
+	dir->ctimeNsec	= st->st_ctim.tv_nsec;
+	return;
+}
+
+/*
+ *	Returns the recorded directory if its subtree cannot contain anything
+ *	older than ddl,the record is then carried to the new index
+ */
+static Age_Dir *age_index_skip(const char *path,const struct stat *st,
+			       time_t age,time_t ddl)
+{
+	Age_Dir key = { .path = path,.age = age };
+	if (!gAgeIndex.oldNum)
+		return NULL;
+
+	Age_Dir *old = bsearch(&key,gAgeIndex.old,gAgeIndex.oldNum,
+			       sizeof(Age_Dir),age_dir_cmp);
+	if (!old)
+		return NULL;
+
+	Age_Dir now = { 0 };
+	age_dir_fill(&now,st);
+	if (now.dev != old->dev || now.ino != old->ino			||
+	    now.mtimeSec != old->mtimeSec || now.mtimeNsec != old->mtimeNsec ||
+	    now.ctimeSec != old->ctimeSec || now.ctimeNsec != old->ctimeNsec ||
+	    atomic_load(&old->minTime) < ddl)
+		return NULL;
+
+	old->carried = true;
+	atomic_fetch_add(&gCounter.skippedDirs,1);
+	return old;
+}
+
+// wd is the watch descriptor of the directory,or -1
+static Age_Dir *age_index_add(const char *path,const struct stat *st,
+			      time_t age,int wd)
+{
+	size_t length = strlen(path);
+	memory_charge(sizeof(Age_Dir) + length + 1);
+	Age_Dir *dir = malloc(sizeof(Age_Dir) + length + 1);
+	check(dir,"Cannot allocate memory for age index\n");
+
+	*dir = (Age_Dir) {
+			.path		= memcpy(dir + 1,path,length + 1),
+			.age		= age,
+			.listed		= true,
+			.wd		= wd,
+			.heapIdx	= SIZE_MAX,
+		 };
+	age_dir_fill(dir,st);
+	atomic_init(&dir->minTime,LLONG_MAX);
+
+	pthread_mutex_lock(&gAgeIndex.lock);
+	dir->next	= gAgeIndex.list;
+	gAgeIndex.list	= dir;
+	gAgeIndex.num++;
+	if (wd >= 0)
+		watch_insert(dir);
+	pthread_mutex_unlock(&gAgeIndex.lock);
+
+	return dir;
+}
+
+static void age_dir_free(Age_Dir *dir)
+{
+	memory_uncharge(sizeof(Age_Dir) + strlen(dir->path) + 1);
+	free(dir);
+	return;
+}
+
+// Scan a watched directory again,recording its entries from scratch
+static void age_index_reuse(Age_Dir *dir)
+{
+	atomic_store(&dir->minTime,LLONG_MAX);
+
+	pthread_mutex_lock(&gAgeIndex.lock);
+	if (!dir->listed) {
+		dir->listed	= true;
+		dir->next	= gAgeIndex.list;
+		gAgeIndex.list	= dir;
+		gAgeIndex.num++;
+	}
+	pthread_mutex_unlock(&gAgeIndex.lock);
+	return;
+}
+
+/*
+ *	Start watching a directory. Returns its record if it is watched for
+ *	the age already,*wd is set to the watch descriptor otherwise.
+ */
+static Age_Dir *watch_dir(const char *path,time_t age,int *wd)
+{
+	*wd = inotify_add_watch(gWatch.fd,path,WATCH_MASK);
+	if (*wd < 0) {
+		log_errno(LOG_WARNING,errno,"Cannot watch directory %s\n",path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&gAgeIndex.lock);
+	Age_Dir *dir = watch_lookup(*wd,age);
+	pthread_mutex_unlock(&gAgeIndex.lock);
+	return dir;
+}
+
+static void atomic_min(atomic_llong *p,long long int t)
+{
+	long long int old = atomic_load(p);
+	while (t < old && !atomic_compare_exchange_weak(p,&old,t))
+		;
+	return;
+}
+
+static void age_dir_fold(Age_Dir *dir,long long int t)
+{
+	if (dir)
+		atomic_min(&dir->minTime,t);
+	return;
+}
+
+typedef struct {
+	time_t ddl,age;
+} Clean_Ctx;
+
+/*
+ *	The earliest time anything expires after cleaning,LLONG_MAX if nothing
+ *	is cleaned. Entries that should have expired already could not be
+ *	removed,they are tried again with files created after the run.
+ */
+static atomic_llong gNextExpiry = LLONG_MAX;
+
+static void clean_next_expiry(const Clean_Ctx *clean,long long int last)
+{
+	if (last >= clean->ddl)
+		atomic_min(&gNextExpiry,last + clean->age + 1);
+	return;
+}
+
+static bool clean_enter(const Walk_Entry *entry,void **data,void *ctx)
+{
+	Clean_Ctx *clean = ctx;
+	time_t last = get_last_time(entry->st);
+
+	// The directory itself may have expired
+	Age_Dir *old = last >= clean->ddl ? age_index_skip(entry->path,
+							   entry->st,
+							   clean->age,
+							   clean->ddl) :
+					    NULL;
+	if (old) {
+		long long int t = atomic_load(&old->minTime);
+		age_dir_fold(entry->parentData,t < last ? t : last);
+		clean_next_expiry(clean,t);
+		return false;
+	}
+
+	int wd = -1;
+	if (gArg.watch) {
+		Age_Dir *known = watch_dir(entry->path,clean->age,&wd);
+
+		// Watched directories are scanned when they expire
+		if (known && last >= clean->ddl) {
+			age_dir_fold(entry->parentData,last);
+			return false;
+		} else if (known) {
+			age_index_reuse(known);
+			*data = known;
+			return true;
+		}
+	}
+
+	*data = age_index_add(entry->path,entry->st,clean->age,wd);
+	return true;
+}
+
+static void clean_file(const Walk_Entry *entry,void *ctx)
+{
+	Clean_Ctx *clean = ctx;
+	Age_Dir *dir = entry->data;
+	time_t last = get_last_time(entry->st);
+
+	bool survivors = gArg.dryRun && dir &&
+			 atomic_load(&dir->minTime) != LLONG_MAX;
+	if (last < clean->ddl && !survivors) {
+		if (!io_unlinkat(entry->dirFd,entry->name,
+				 entry->isDir ? AT_REMOVEDIR : 0,
+				 entry->path)) {
+			// Queued removals failing later are counted as well
+			if (!gArg.dryRun && !entry->isDir &&
+			    entry->st->st_nlink == 1 && metrics_get())
+				tMetrics->reclaimed += entry->st->st_blocks * 512;
+			if (dir)
+				dir->dropped = true;
+			return;
+		}
+
+		// Directories containing files not expired yet are kept
+		if (!entry->isDir || (errno != ENOTEMPTY && errno != EEXIST))
+			log_errno(LOG_WARNING,errno,"Cannot remove file %s\n",
+				  entry->path);
+	}
+
+	// Removals queued for io_uring are checked in age_index_save()
+	if (dir) {
+		long long int t = atomic_load(&dir->minTime);
+		last = t < last ? t : last;
+		dir->dropped = entry->partial;
+	}
+	age_dir_fold(entry->parentData,last);
+	clean_next_expiry(clean,last);
+	return;
+}
+
+def_handler(attr_clean)
+{
+	handler_ignore;
+
+	if (!gArg.clean)
+		return;
+
+	time_t maxAge = in->op.age;
+	if (maxAge == (time_t)-1 || is_excluded(path))	// No age,never clean
+		return;
+	if ((gCheckpoint.path || gCheckpoint.budgetNs) && checkpoint_poll())
+		return;
+
+	/*
+	 *	A dry run removes nothing,so directory records tell whether a
+	 *	directory would be empty when it is reached.
+	 */
+	time_t now = time(NULL);
+	Clean_Ctx clean = { .ddl = now - maxAge,.age = maxAge };
+	Age_Dir *top = NULL;
+
+	// Nothing created after now expires earlier
+	atomic_min(&gNextExpiry,now + maxAge + 1);
+
+	if ((gArg.ageIndexPath || gArg.dryRun || gArg.watch) &&
+	    file_state_get(path,state)) {
+		Age_Dir *old = age_index_skip(path,&state->st,maxAge,clean.ddl);
+		if (old) {
+			clean_next_expiry(&clean,atomic_load(&old->minTime));
+			return;
+		}
+
+		int wd = -1;
+		top = gArg.watch ? watch_dir(path,maxAge,&wd) : NULL;
+		if (top)
+			age_index_reuse(top);
+		else
+			top = age_index_add(path,&state->st,maxAge,wd);
+	}
+
+	Walk_Progress progress = {
+				.source	= in->source,
+				.line	= in->line,
+				.path	= path,
+			    };
+	Walk_Progress *tracked = NULL;
+	if (gCheckpoint.path || gCheckpoint.budgetNs) {
+		Checkpoint_Record *old = checkpoint_find(in->source,in->line,
+							 path);
+		if (old && !old->cursor) {
+			checkpoint_done(in->source,in->line,path);
+			if (top)
+				top->dropped = true;
+			return;
+		}
+		progress.resume = old ? old->cursor : NULL;
+		pthread_mutex_init(&progress.lock,NULL);
+		tracked = &progress;
+	}
+
+	int flags = WALK_RECURSIVE | WALK_STAT | WALK_EXCLUDE;
+	if (iterate_directory(path,clean_file,top ? clean_enter : NULL,top,
+			      &clean,flags,tracked) && top)
+		top->dropped = true;
+
+	if (tracked)
+		pthread_mutex_destroy(&progress.lock);
+	return;
+}
+
+/*
+ *	Sleep until the next expiry (--until-next),so the next run is not
+ *	started earlier than needed
+ */
+static void clean_until_next(void)
+{
+	long long int next = atomic_load(&gNextExpiry);
+	if (next == LLONG_MAX)
+		return;
+
+	// The sleep may be long or never end,so nothing is kept buffered
+	fflush(stdout);
+	log_flush();
+
+	struct timespec t = { .tv_sec = next };
+	while (clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&t,NULL) == EINTR)
+		;
+	return;
+}
+
+/*
+ *	Queue directories recorded by the last scans by the time their oldest
+ *	entry expires. Those that cannot be removed yet (e.g. directories not
+ *	empty) are retried after another period of their age.
+ */
+static void watch_settle(time_t now)
+{
+	while (gAgeIndex.list) {
+		Age_Dir *dir	= gAgeIndex.list;
+		gAgeIndex.list	= dir->next;
+		dir->listed	= false;
+
+		if (dir->wd < 0) {
+			age_dir_free(dir);
+			continue;
+		}
+
+		long long int t = atomic_load(&dir->minTime);
+		if (t == LLONG_MAX) {
+			watch_heap_remove(dir);
+			continue;
+		}
+
+		int64_t deadline = t + dir->age + 1;
+		watch_schedule(dir,deadline > now ? deadline : now + dir->age);
+	}
+	gAgeIndex.num = 0;
+	return;
+}
+
+static void watch_event(const struct inotify_event *event,time_t now)
+{
+	if (event->mask & IN_Q_OVERFLOW) {
+		log_warn("Events lost,scanning every watched directory\n");
+		for (size_t i = 0;i < gWatch.bucketNum;i++) {
+			for (Age_Dir *dir = gWatch.buckets[i];dir;
+			     dir = dir->watchNext)
+				watch_schedule(dir,now);
+		}
+		return;
+	}
+
+	Age_Dir **p = watch_bucket(event->wd);
+	while (*p) {
+		Age_Dir *dir = *p;
+		if (dir->wd != event->wd) {
+			p = &dir->watchNext;
+			continue;
+		}
+
+		// The directory has gone
+		if (event->mask & IN_IGNORED) {
+			*p = dir->watchNext;
+			gWatch.num--;
+			watch_heap_remove(dir);
+			age_dir_free(dir);
+			continue;
+		}
+
+		// New directories are watched when their parent is scanned
+		int64_t deadline = event->mask & IN_ISDIR ? now :
+							   now + dir->age + 1;
+		if (dir->heapIdx == SIZE_MAX || deadline < dir->deadline)
+			watch_schedule(dir,deadline);
+		p = &dir->watchNext;
+	}
+	return;
+}
+
+static void watch_read(void)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	while ((length = read(gWatch.fd,buf,sizeof(buf))) > 0) {
+		time_t now = time(NULL);
+		for (char *p = buf;p < buf + length;) {
+			const struct inotify_event *event = (void *)p;
+			watch_event(event,now);
+			p += sizeof(*event) + event->len;
+		}
+	}
+	check_errno(length >= 0 || errno == EAGAIN || errno == EINTR,
+		    "Cannot read inotify events\n");
+	return;
+}
+
+static void watch_scan(Age_Dir *dir,time_t now)
+{
+	Clean_Ctx clean = { .ddl = now - dir->age,.age = dir->age };
+	age_index_reuse(dir);
+
+	int flags = WALK_RECURSIVE | WALK_STAT | WALK_EXCLUDE;
+	iterate_directory(dir->path,clean_file,clean_enter,dir,&clean,flags,
+			  NULL);
+	io_flush();
+	return;
+}
+
+/*
+ *	Clean directories once the oldest entry in them has expired,instead
+ *	of scanning regularly. Never returns.
+ */
+static void watch_run(void)
+{
+	watch_settle(time(NULL));
+	log_info("Watching %zu directories\n",gWatch.num);
+
+	for (;;) {
+		watch_read();
+
+		time_t now = time(NULL);
+		if (gWatch.heapNum && gWatch.heap[0]->deadline <= now) {
+			Age_Dir *dir = gWatch.heap[0];
+			watch_heap_remove(dir);
+			watch_scan(dir,now);
+			watch_settle(now);
+			continue;
+		}
+
+		int timeout = -1;
+		if (gWatch.heapNum) {
+			int64_t left = gWatch.heap[0]->deadline - now;
+			timeout = left > INT_MAX / 1000 ? INT_MAX :
+							  (int)left * 1000;
+		}
+
+		log_flush();
+		struct pollfd pfd = { .fd = gWatch.fd,.events = POLLIN };
+		check_errno(poll(&pfd,1,timeout) >= 0 || errno == EINTR,
+			    "Cannot wait for inotify events\n");
+	}
+}
+
+/*
+ *	Types q,Q and v create a subvolume on btrfs,and a plain directory
+ *	(by attr_createdir()) elsewhere or if it is not permitted. Quota
+ *	groups are not set up.
+ */
+def_handler(attr_createsubvol)
+{
+	handler_ignore;
+
+	if (!gArg.create || !state->fs->subvol || file_state_get(path,state))
+		return;
+
+	const char *name;
+	int fd = open_parent(path,&name);
+	if (fd < 0)
+		return;
+
+	struct btrfs_ioctl_vol_args args = { 0 };
+	if (strlen(name) <= BTRFS_PATH_NAME_MAX) {
+		strcpy(args.name,name);
+		stats_count(STAT_IOCTL,1);
+		if (dry_run(DRY_CREATE,path,0) ||
+		    !ioctl(fd,BTRFS_IOC_SUBVOL_CREATE,&args))
+			file_state_created(state,S_IFDIR);
+		else
+			log_errno(LOG_INFO,errno,"Cannot create subvolume %s,"
+				  "creating a directory\n",path);
+	}
+	close(fd);
+	return;
+}
+
+def_handler(attr_createdir)
+{
+	handler_ignore;
+
+	if (!gArg.create)
+		return;
+
+	if (!file_state_get(path,state)) {
+		if (io_mkdirat(AT_FDCWD,path,0755))
+			log_errno(LOG_WARNING,errno,
+				  "Cannot create directory %s\n",path);
+		file_state_created(state,S_IFDIR);
+	}
+	return;
+}
+
+def_handler(attr_create)
+{
+	handler_ignore;
+	if (!gArg.create)
+		return;
+
+	if (!file_state_get(path,state)) {
+		if (io_creat(AT_FDCWD,path,0644)) {
+			log_errno(LOG_WARNING,errno,"Cannot create file %s\n",
+				  path);
+			return;
+		}
+		file_state_created(state,S_IFREG);
+	}
+	return;
+}
+
+def_handler(attr_perm)
+{
+	handler_ignore;
+
+	mode_t target = in->op.mode;
+	if (target == (mode_t)-1)		// Simply ignore
+		return;
+
+	const struct stat *st = file_state_get(path,state);
+	if (st && (st->st_mode & 07777) == target) {
+		atomic_fetch_add(&gCounter.skipped,1);
+		return;
+	}
+
+	stats_count(STAT_CHMOD,1);
+	if (dry_run(DRY_CHMOD,path,0))
+		return;
+	if (chmod(path,target))
+		log_errno(LOG_WARNING,errno,
+			  "Cannot set file mode as %04o for %s\n",
+			  (unsigned int)target,path);
+
+	return;
+}
+
+/*
+ *	User and group cache
+ *	Names are looked up once per run. If NSS uses nothing but files for
+ *	the database (or there is no nsswitch.conf at all),the whole of
+ *	/etc/passwd or /etc/group is loaded in one pass,otherwise the
+ *	results of getpwnam()/getgrnam() are cached.
+ */
+#define ID_HASH_SIZE		256
+
+typedef struct Id_Entry {
+	struct Id_Entry *next;
+	unsigned long int id;
+	bool valid;
+	char name[];
+} Id_Entry;
+
+typedef struct {
+	const char *db;			// Name in nsswitch.conf
+	const char *file;
+	bool loaded,filesOnly;
+	pthread_mutex_t lock;		// Entries run in parallel with --jobs
+	Id_Entry *buckets[ID_HASH_SIZE];
+} Id_Cache;
+
+static Id_Cache gUserCache = {
+					.db	= "passwd",
+					.file	= "/etc/passwd",
+					.lock	= PTHREAD_MUTEX_INITIALIZER,
+			       };
+static Id_Cache gGroupCache = {
+					.db	= "group",
+					.file	= "/etc/group",
+					.lock	= PTHREAD_MUTEX_INITIALIZER,
+			        };
+
+static Id_Entry *id_cache_insert(Id_Cache *cache,const char *name,
+				 size_t length,unsigned long int id,bool valid)
+{
+	Id_Entry *entry = malloc(sizeof(Id_Entry) + length + 1);
+	check(entry,"Cannot allocate memory for user %s\n",name);
+
+	memcpy(entry->name,name,length);
+	entry->name[length]	= '\0';
+	entry->id		= id;
+	entry->valid		= valid;
+
+	unsigned int h = hash_string(entry->name) % ID_HASH_SIZE;
+	entry->next		= cache->buckets[h];
+	cache->buckets[h]	= entry;
+	return entry;
+}
+
+static bool nss_files_only(const char *db)
+{
+	FILE *fp = fopen("/etc/nsswitch.conf","r");
+	if (!fp)
+		return true;
+
+	char line[512];
+	size_t dbLen = strlen(db);
+	bool filesOnly = false;
+	while (fgets(line,sizeof(line),fp)) {
+		char *p = skip_space(line);
+		if (strncmp(p,db,dbLen) || p[dbLen] != ':')
+			continue;
+
+		filesOnly = true;
+		char *save;
+		for (char *t = strtok_r(p + dbLen + 1," \t\n",&save);t;
+		     t = strtok_r(NULL," \t\n",&save)) {
+			if (strcmp(t,"files"))
+				filesOnly = false;
+		}
+		break;
+	}
+
+	fclose(fp);
+	return filesOnly;
+}
+
+/*
+ *	Both /etc/passwd and /etc/group start with "name:password:id:"
+ */
+static void id_cache_load(Id_Cache *cache)
+{
+	cache->loaded		= true;
+	cache->filesOnly	= nss_files_only(cache->db);
+	if (!cache->filesOnly)
+		return;
+
+	FILE *fp = fopen(cache->file,"r");
+	if (!fp) {
+		cache->filesOnly = false;
+		return;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	while (getline(&line,&size,fp) > 0) {
+		char *name = line,*p = strchr(line,':');
+		if (!p || !(p = strchr(p + 1,':')))
+			continue;
+
+		char *end;
+		unsigned long int id = strtoul(p + 1,&end,10);
+		if (end == p + 1 || *end != ':')
+			continue;
+		id_cache_insert(cache,name,strcspn(name,":"),id,true);
+	}
+
+	free(line);
+	fclose(fp);
+	return;
+}
+
+/*
+ *	Returns 0 and sets *id on success
+ */
+static int id_cache_lookup(Id_Cache *cache,const char *name,
+			   unsigned long int *id)
+{
+	char *end;
+	*id = strtoul(name,&end,10);
+	if (isdigit((unsigned char)name[0]) && !*end)	// Numeric ID
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (!cache->loaded)
+		id_cache_load(cache);
+
+	unsigned int h = hash_string(name) % ID_HASH_SIZE;
+	for (Id_Entry *entry = cache->buckets[h];entry;entry = entry->next) {
+		if (!strcmp(entry->name,name)) {
+			*id = entry->id;
+			pthread_mutex_unlock(&cache->lock);
+			return entry->valid ? 0 : -1;
+		}
+	}
+
+	if (cache->filesOnly) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+
+	bool valid;
+	if (cache == &gUserCache) {
+		struct passwd *pswd = getpwnam(name);
+		valid	= pswd;
+		*id	= valid ? pswd->pw_uid : 0;
+	} else {
+		struct group *grpInfo = getgrnam(name);
+		valid	= grpInfo;
+		*id	= valid ? grpInfo->gr_gid : 0;
+	}
+	id_cache_insert(cache,name,strlen(name),*id,valid);
+	pthread_mutex_unlock(&cache->lock);
+
+	return valid ? 0 : -1;
+}
+
+static void id_cache_free(Id_Cache *cache)
+{
+	for (int i = 0;i < ID_HASH_SIZE;i++) {
+		for (Id_Entry *entry = cache->buckets[i],*next;entry;
+		     entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		cache->buckets[i] = NULL;
+	}
+	return;
+}
+
+def_handler(attr_ownership)
+{
+	handler_ignore;
+
+	uid_t uid = in->op.uid;
+	gid_t gid = in->op.gid;
+	if (uid == (uid_t)-1 && gid == (gid_t)-1)
+		return;
+
+	const struct stat *st = file_state_get(path,state);
+	if (st && (uid == (uid_t)-1 || st->st_uid == uid) &&
+	    (gid == (gid_t)-1 || st->st_gid == gid)) {
+		atomic_fetch_add(&gCounter.skipped,1);
+		return;
+	}
+
+	stats_count(STAT_CHOWN,1);
+	if (dry_run(DRY_CHOWN,path,0))
+		return;
+	if (fchownat(AT_FDCWD,path,uid,gid,0))
+		log_errno(LOG_WARNING,errno,
+			  "Cannot transfer file %s to %s:%s\n",path,
+			  in->userName,in->grpName);
+	return;
+}
+
+/*
+ *	Returns true if the regular file at path already holds exactly
+ *	content. Files on procfs and sysfs are always written,as their size
+ *	and what is read back mean nothing.
+ */
+static bool file_content_same(const char *path,const struct stat *st,
+			      const char *content,size_t length)
+{
+	if (!S_ISREG(st->st_mode) || (size_t)st->st_size != length)
+		return false;
+
+	stats_count(STAT_OPEN,1);
+	int fd = open(path,O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0)
+		return false;
+
+	struct statfs fs;
+	bool same = !fstatfs(fd,&fs)			&&
+		    fs.f_type != PROC_SUPER_MAGIC	&&
+		    fs.f_type != SYSFS_MAGIC;
+
+	char buf[4096];
+	for (size_t off = 0;same && off < length;) {
+		size_t size = length - off < sizeof(buf) ? length - off :
+							   sizeof(buf);
+		ssize_t ret = read(fd,buf,size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		same = ret > 0 && !memcmp(buf,content + off,ret);
+		off += ret > 0 ? ret : 0;
+	}
+	close(fd);
+
+	return same;
+}
+
+/*
+ *	The content is written with as few write() as possible (one for most
+ *	tunables),short writes are continued from where they stopped
+ */
+static void write_content(const char *path,const char *content,bool append,
+			  File_State *state)
+{
+	const struct stat *st = file_state_get(path,state);
+	if (!st)
+		return;
+
+	size_t length = strlen(content);
+	if (!append && file_content_same(path,st,content,length)) {
+		atomic_fetch_add(&gCounter.skipped,1);
+		return;
+	}
+
+	stats_count(STAT_OPEN,1);
+	if (gArg.dryRun) {
+		stats_count(STAT_WRITTEN,length);
+		dry_run(DRY_WRITE,path,0);
+		return;
+	}
+
+	int fd = open(path,O_WRONLY | O_CLOEXEC | O_NOCTTY |
+			   (append ? O_APPEND : O_TRUNC));
+	if (fd < 0) {
+		log_errno(LOG_WARNING,errno,"Cannot open file %s\n",path);
+		return;
+	}
+
+	for (size_t off = 0;off < length;) {
+		ssize_t ret = write(fd,content + off,length - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			log_errno(LOG_WARNING,ret < 0 ? errno : EIO,
+				  "Cannot write to file %s\n",path);
+			break;
+		}
+		stats_count(STAT_WRITTEN,ret);
+		off += ret;
+	}
+	close(fd);
+
+	state->valid = false;
+	return;
+}
+
+def_handler(attr_write)
+{
+	handler_ignore;
+
+	if (gArg.create)
+		write_content(path,in->arg,false,state);
+	return;
+}
+
+// Type w+,each entry for the same path appends its argument with a write()
+def_handler(attr_append)
+{
+	handler_ignore;
+
+	if (gArg.create)
+		write_content(path,in->arg,true,state);
+	return;
+}
+
+/*
+ *	Trees are removed bottom-up by the walker with unlinkat(). On btrfs,
+ *	a subvolume (whose root is always inode 256) is deleted at once with
+ *	BTRFS_IOC_SNAP_DESTROY,which may not be permitted,then it is emptied
+ *	like a directory and removed with rmdir().
+ */
+#define BTRFS_SUBVOL_INO	256	// BTRFS_FIRST_FREE_OBJECTID
+
+static bool btrfs_subvol_destroy(int dirFd,const char *name,const char *path)
+{
+	struct stat st;
+	stats_count(STAT_STAT,1);
+	if (fstatat(dirFd,name,&st,AT_SYMLINK_NOFOLLOW) ||
+	    !S_ISDIR(st.st_mode) || st.st_ino != BTRFS_SUBVOL_INO)
+		return false;
+
+	struct btrfs_ioctl_vol_args args = { 0 };
+	if (strlen(name) > BTRFS_PATH_NAME_MAX)
+		return false;
+	strcpy(args.name,name);
+
+	stats_count(STAT_IOCTL,1);
+	if (dry_run(DRY_REMOVE,path,0))
+		return true;
+	if (ioctl(dirFd,BTRFS_IOC_SNAP_DESTROY,&args)) {
+		log_errno(LOG_INFO,errno,
+			  "Cannot delete subvolume %s,removing its content\n",
+			  path);
+		return false;
+	}
+	return true;
+}
+
+static bool remove_enter(const Walk_Entry *entry,void **data,void *ctx)
+{
+	(void)data;
+	bool btrfs = *(bool*)ctx;
+	return !btrfs || !btrfs_subvol_destroy(entry->dirFd,entry->name,
+					       entry->path);
+}
+
+static void do_remove(const Walk_Entry *entry,void *ctx)
+{
+	(void)ctx;
+	if (io_unlinkat(entry->dirFd,entry->name,
+			entry->isDir ? AT_REMOVEDIR : 0,entry->path))
+		log_errno(LOG_WARNING,errno,"Cannot remove file %s\n",
+			  entry->path);
+	return;
+}
+
+static void remove_content(const char *path,const File_State *state)
+{
+	bool btrfs = state->fs->subvol;
+	iterate_directory(path,do_remove,remove_enter,NULL,&btrfs,
+			  WALK_RECURSIVE | WALK_HIDDEN,NULL);
+	return;
+}
+
+def_handler(attr_remove)
+{
+	handler_ignore;
+
+	if (!gArg.remove)
+		return;
+
+	if (is_directory(path)) {
+		remove_content(path,state);
+	} else if (io_unlinkat(AT_FDCWD,path,0,path)) {
+		log_errno(LOG_WARNING,errno,"Cannot remove file %s\n",path);
+	}
+
+	return;
+}
+
+// Type R,the directory itself is removed as well
+def_handler(attr_remove_tree)
+{
+	handler_ignore;
+
+	if (!gArg.remove)
+		return;
+
+	const struct stat *st = file_state_get(path,state);
+	if (!st)
+		return;
+
+	if (S_ISDIR(st->st_mode)) {
+		const char *name;
+		int fd = state->fs->subvol ? open_parent(path,&name) : -1;
+		if (fd >= 0) {
+			bool done = btrfs_subvol_destroy(fd,name,path);
+			close(fd);
+			if (done) {
+				state->valid = false;
+				return;
+			}
+		}
+
+		remove_content(path,state);
+		if (io_unlinkat(AT_FDCWD,path,AT_REMOVEDIR,path))
+			log_errno(LOG_WARNING,errno,
+				  "Cannot remove directory %s\n",path);
+	} else if (io_unlinkat(AT_FDCWD,path,0,path)) {
+		log_errno(LOG_WARNING,errno,"Cannot remove file %s\n",path);
+	}
+
+	state->valid = false;
+	return;
+}
+
+/*
+ *	Open a file for FS_IOC_[GS]ETFLAGS. It is opened with O_PATH first,
+ *	so a FIFO or device is never opened for real,and reopened through
+ *	procfs,or by name if procfs is not mounted as long as it is still the
+ *	same file. Returns -1 if it should be skipped.
+ */
+static int attr_open(int dirFd,const char *name,const char *path)
+{
+	stats_count(STAT_OPEN,1);
+	int pathFd = openat(dirFd,name,O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+	if (pathFd < 0 || fstat(pathFd,&st)) {
+		log_errno(LOG_WARNING,errno,"Cannot open file %s\n",path);
+		if (pathFd >= 0)
+			close(pathFd);
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+		log_info("Skipped attributes of %s,which is neither a regular "
+			 "file nor a directory\n",path);
+		close(pathFd);
+		return -1;
+	}
+
+	int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+	char proc[32];
+	snprintf(proc,sizeof(proc),"/proc/self/fd/%d",pathFd);
+	stats_count(STAT_OPEN,1);
+	int fd = open(proc,flags);
+	if (fd < 0 && errno == ENOENT) {
+		struct stat now;
+		fd = openat(dirFd,name,flags | O_NOFOLLOW);
+		if (fd >= 0 && (fstat(fd,&now) || now.st_dev != st.st_dev ||
+				now.st_ino != st.st_ino)) {
+			close(fd);
+			fd = -1;
+			errno = ESTALE;
+		}
+	}
+	if (fd < 0)
+		log_errno(LOG_WARNING,errno,"Cannot open file %s\n",path);
+
+	close(pathFd);
+	return fd;
+}
+
+static void attr_apply(int fd,const char *path,const Entry_Op *op,
+		       const Fs_Profile *fs)
+{
+	unsigned long int set = op->attrSet,clear = op->attrClear;
+
+	// Skip attributes the filesystem cannot store
+	if (fs && fs->attrFlags) {
+		if (set & ~fs->attrFlags)
+			log_info("Attributes of %s not supported on %s,"
+				 "skipped\n",path,fs->name);
+		set	&= fs->attrFlags;
+		clear	&= fs->attrFlags;
+		if (!set && !clear)
+			return;
+	}
+
+	int origin;
+	stats_count(STAT_IOCTL,1);
+	if (ioctl(fd,FS_IOC_GETFLAGS,&origin)) {
+		log_errno(LOG_WARNING,errno,"Cannot get attributes of %s\n",
+			  path);
+		return;
+	}
+
+	int target = (origin & ~(int)clear) | (int)set;
+	if (target == origin) {
+		atomic_fetch_add(&gCounter.skipped,1);
+		return;
+	}
+
+	stats_count(STAT_IOCTL,1);
+	if (dry_run(DRY_ATTR,path,0))
+		return;
+	if (ioctl(fd,FS_IOC_SETFLAGS,&target))
+		log_errno(LOG_WARNING,errno,"Cannot set attributes of %s\n",
+			  path);
+	return;
+}
+
+def_handler(attr_attr)
+{
+	handler_ignore;
+
+	int fd = attr_open(AT_FDCWD,path,path);
+	if (fd >= 0) {
+		attr_apply(fd,path,&in->op,state->fs);
+		close(fd);
+	}
+	return;
+}
+
+static void attr_tree_file(const Walk_Entry *entry,void *ctx)
+{
+	int fd = attr_open(entry->dirFd,entry->name,entry->path);
+	if (fd >= 0) {
+		attr_apply(fd,entry->path,ctx,tFsProfile);
+		close(fd);
+	}
+	return;
+}
+
+// Type H,the directory and everything inside
+def_handler(attr_attr_tree)
+{
+	handler_ignore;
+
+	int fd = attr_open(AT_FDCWD,path,path);
+	if (fd < 0)
+		return;
+	attr_apply(fd,path,&in->op,state->fs);
+	close(fd);
+
+	if (is_directory(path))
+		iterate_directory(path,attr_tree_file,NULL,NULL,
+				  (void *)&in->op,
+				  WALK_RECURSIVE | WALK_HIDDEN,NULL);
+	return;
+}
+
+typedef void (*Attr_Handler)(const char *path,const Process_File_In *in,
+			     File_State *state);
+
+/*
+ *	Handlers in the order they run,a directory is created before its
+ *	mode is set
+ */
+static const struct {
+	Entry_Attribute attr;
+	Attr_Handler handler;
+	const char *name;
+} gHandlers[] = {
+		{ ATTR_CREATE,		attr_create,		"attr_create"	    },
+		{ ATTR_APPEND,		attr_append,		"attr_append"	    },
+		{ ATTR_SUBVOL,		attr_createsubvol,	"attr_createsubvol" },
+		{ ATTR_CREATEDIR,	attr_createdir,		"attr_createdir"    },
+		{ ATTR_PERM,		attr_perm,		"attr_perm"	    },
+		{ ATTR_RECUR,		attr_remove_tree,	"attr_remove_tree"  },
+		{ ATTR_WRITE,		attr_write,		"attr_write"	    },
+		{ ATTR_OWNERSHIP,	attr_ownership,		"attr_ownership"    },
+		{ ATTR_CLEAN,		attr_clean,		"attr_clean"	    },
+		{ ATTR_REMOVE,		attr_remove,		"attr_remove"	    },
+		{ ATTR_ATTR,		attr_attr,		"attr_attr"	    },
+		{ ATTR_ATTRTREE,	attr_attr_tree,		"attr_attr_tree"    },
+	};
+#define HANDLER_COUNT (sizeof(gHandlers) / sizeof(gHandlers[0]))
+
+// Handlers needed by in->attr,so files are not checked against every bit
+static void handlers_select(Process_File_In *in)
+{
+	in->op.handlerNum = 0;
+	for (size_t i = 0;i < HANDLER_COUNT;i++) {
+		if (in->attr & gHandlers[i].attr)
+			in->op.handlers[in->op.handlerNum++] = i;
+	}
+	return;
+}
+
+static void process_file(const char *path,void *ctx)
+{
+	Process_File_In *in = ctx;
+	File_State state = { .valid = false };
+	state.fs	= fs_profile_get(path,&state);
+	tFsProfile	= state.fs;
+	if (metrics_get())
+		tMetrics->files[in->type & (METRICS_TYPE_NUM - 1)]++;
+
+	for (int j = 0;j < in->op.handlerNum;j++) {
+		int i = in->op.handlers[j];
+		uint64_t start = gArg.stats ? monotonic_ns() : 0;
+		gHandlers[i].handler(path,in,&state);
+		if (gArg.stats) {
+			atomic_fetch_add_explicit(&gStats.handlerCalls[i],1,
+						  memory_order_relaxed);
+			atomic_fetch_add_explicit(&gStats.handlerNs[i],
+						  monotonic_ns() - start,
+						  memory_order_relaxed);
+		}
+	}
+
+	tFsProfile = NULL;
+	return;
+}
+
+/*
+ *	Execution plan
+ *	All configuration files are parsed into the plan first. Entries are
+ *	then sorted by path (parents before children,subtrees together),
+ *	duplicated ones are dropped,and 'x' entries are applied before
+ *	anything is executed.
+ */
+typedef struct {
+	File_Entry file;		// attr with ATTR_GLOB and ATTR_ONBOOT
+	Process_File_In in;
+	const char *source;
+	unsigned int line;
+	size_t seq;			// Parsing order
+	bool removed;
+	Entry_Attribute deferred;	// Handlers run after readiness
+} Plan_Entry;
+
+enum {
+	PHASE_ALL,
+	PHASE_CREATE,			// Handlers not deferred
+	PHASE_DEFERRED,
+};
+
+static struct {
+	Plan_Entry *entries;
+	size_t num,cap;
+	void *cacheMap;			// Strings loaded from the cache
+	size_t cacheSize;
+	int phase;			// PHASE_*
+} gPlan;
+
+static Plan_Entry *plan_add(void)
+{
+	if (gPlan.num == gPlan.cap) {
+		size_t cap = gPlan.cap ? gPlan.cap * 2 : 64;
+		memory_charge(sizeof(Plan_Entry) * (cap - gPlan.cap));
+		Plan_Entry *entries = realloc(gPlan.entries,
+					      sizeof(Plan_Entry) * cap);
+		check(entries,"Cannot allocate memory for entries\n");
+		gPlan.entries	= entries;
+		gPlan.cap	= cap;
+	}
+
+	Plan_Entry *entry = &gPlan.entries[gPlan.num];
+	memset(entry,0,sizeof(*entry));
+	entry->seq = gPlan.num++;
+	return entry;
+}
+
+static int plan_entry_cmp(const void *pa,const void *pb)
+{
+	const Plan_Entry *a = pa,*b = pb;
+	int ret = path_cmp(a->file.path,b->file.path);
+	return ret ? ret : a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static bool plan_entry_same(const Plan_Entry *a,const Plan_Entry *b)
+{
+	return a->file.attr == b->file.attr			&&
+	       !strcmp(a->in.modeStr,b->in.modeStr)		&&
+	       !strcmp(a->in.userName,b->in.userName)		&&
+	       !strcmp(a->in.grpName,b->in.grpName)		&&
+	       !strcmp(a->in.ageStr,b->in.ageStr)		&&
+	       !strcmp(a->in.arg,b->in.arg);
+}
+
+/*
+ *	Parse fields of the entry into entry->in.op once,users and groups are
+ *	looked up here (inside the root with --root). Attributes of h and H are
+ *	prefixed with '+' (the default) to add them,'-' to remove them or '='
+ *	to set exactly them.
+ */
+static void plan_compile(Plan_Entry *entry)
+{
 	static unsigned long int flags[256] = {
 			['a']	= FS_APPEND_FL,
 			['D']	= FS_DIRSYNC_FL,
@@ -448,201 +4136,2107 @@ static void do_set_file_attr(const char *path,void *in)
 			['T']	= FS_TOPDIR_FL,
 			['u']	= FS_UNRM_FL,
 		};
+	const unsigned long int all = FS_APPEND_FL | FS_DIRSYNC_FL |
+				      FS_IMMUTABLE_FL | FS_JOURNAL_DATA_FL |
+				      FS_NOATIME_FL | FS_NOCOW_FL |
+				      FS_NODUMP_FL | FS_NOTAIL_FL |
+				      FS_PROJINHERIT_FL | FS_SECRM_FL |
+				      FS_SYNC_FL | FS_TOPDIR_FL | FS_UNRM_FL;
+
+	Process_File_In *in = &entry->in;
+	in->source	= entry->source;
+	in->line	= entry->line;
+	in->op.mode	= (mode_t)-1;
+	in->op.uid	= (uid_t)-1;
+	in->op.gid	= (gid_t)-1;
+	in->op.age	= (time_t)-1;
+
+	if ((in->attr & ATTR_PERM) && in->modeStr[0] && in->modeStr[0] != '-')
+		in->op.mode = (mode_t)strtol(in->modeStr,NULL,8) & 07777;
+
+	if (in->attr & ATTR_CLEAN)
+		in->op.age = convert_age(in->ageStr);
+
+	unsigned long int id;
+	if ((in->attr & ATTR_OWNERSHIP) && in->userName[0] &&
+	    in->userName[0] != '-') {
+		if (id_cache_lookup(&gUserCache,in->userName,&id))
+			log_warn("%s:%u: Invalid user %s\n",entry->source,
+				 entry->line,in->userName);
+		else
+			in->op.uid = id;
+	}
+	if ((in->attr & ATTR_OWNERSHIP) && in->grpName[0] &&
+	    in->grpName[0] != '-') {
+		if (id_cache_lookup(&gGroupCache,in->grpName,&id))
+			log_warn("%s:%u: Invalid group %s\n",entry->source,
+				 entry->line,in->grpName);
+		else
+			in->op.gid = id;
+	}
+
+	if (!(in->attr & (ATTR_ATTR | ATTR_ATTRTREE)))
+		return;
+
+	const char *p = in->arg;
+	char op = *p == '+' || *p == '-' || *p == '=' ? *p++ : '+';
+
+	unsigned long int mask = 0;
+	for (;*p;p++) {
+		if (!flags[(unsigned char)*p])
+			log_warn("%s:%u: Invalid file attribute %c\n",
+				 entry->source,entry->line,*p);
+		mask |= flags[(unsigned char)*p];
+	}
+
+	entry->in.op.attrSet	= op == '-' ? 0 : mask;
+	entry->in.op.attrClear	= op == '-' ? mask :
+				  op == '=' ? all & ~mask : 0;
+	return;
+}
+
+static void plan_resolve(void)
+{
+	qsort(gPlan.entries,gPlan.num,sizeof(Plan_Entry),plan_entry_cmp);
+
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+
+		if ((entry->file.attr & ATTR_ONBOOT) && !gArg.boot) {
+			entry->removed = true;			// Handler '!'
+			continue;
+		}
+
+		if (entry->in.attr & ATTR_EXCLUDE) {
+			exclude_add(entry->file.path);
+			gAgeIndex.excludeHash = gAgeIndex.excludeHash * 31 +
+						hash_string(entry->file.path);
+			entry->removed = true;
+			continue;
+		}
+
+		// A removed directory needs no cleaning
+		if (gArg.remove && (entry->in.attr & ATTR_REMOVE))
+			entry->in.attr &= ~ATTR_CLEAN;
+
+		/*
+		 *	The first entry of the same type for a path wins,and a
+		 *	path is cleaned only once
+		 */
+		for (size_t j = i;j-- > 0;) {
+			Plan_Entry *prev = &gPlan.entries[j];
+			if (strcmp(prev->file.path,entry->file.path))
+				break;
+			if (prev->removed)
+				continue;
+
+			/*
+			 *	Every w+ entry is kept and appended in order with
+			 *	a write() of its own,as each one is a command to
+			 *	files on sysfs,procfs and cgroupfs
+			 */
+			if (prev->file.attr == entry->file.attr &&
+			    (entry->in.attr & ATTR_APPEND))
+				break;
+
+			if (prev->file.attr == entry->file.attr) {
+				if (!plan_entry_same(prev,entry))
+					log_warn("%s:%u: Duplicated entry for "
+						 "%s,ignored\n",
+						 entry->source,entry->line,
+						 entry->file.path);
+				entry->removed = true;
+				break;
+			}
+
+			if (prev->in.attr & ATTR_CLEAN)
+				entry->in.attr &= ~ATTR_CLEAN;
+		}
+
+		if (!entry->removed)
+			plan_compile(entry);
+	}
+
+	return;
+}
+
+// Handlers of the entry to run in the current phase
+static Entry_Attribute plan_entry_attr(const Plan_Entry *entry)
+{
+	if (entry->removed)
+		return 0;
+	return gPlan.phase == PHASE_ALL	   ? entry->in.attr		     :
+	       gPlan.phase == PHASE_CREATE ? entry->in.attr & ~entry->deferred :
+					     entry->in.attr & entry->deferred;
+}
+
+static void plan_run_entry(size_t i)
+{
+	Plan_Entry *entry = &gPlan.entries[i];
+	Process_File_In in = entry->in;
+	in.attr = plan_entry_attr(entry);
+	handlers_select(&in);
+
+	size_t savedLog = tLogEntry;
+	tLogEntry = i + 1;
+
+	uint64_t start = 0;
+	if (gArg.stats) {
+		tEntryStats	= &gStats.entries[i];
+		start		= monotonic_ns();
+	}
+
+	if (entry->file.attr & ATTR_GLOB) {
+		glob_match(entry->file.path,process_file,&in);
+	} else {
+		process_file(entry->file.path,&in);
+	}
+	io_flush();
+
+	if (gArg.stats)
+		gStats.entries[i].timeNs += monotonic_ns() - start;
+
+	char where[PATH_MAX + 64];
+	snprintf(where,sizeof(where),"%s:%u: %s",entry->source,entry->line,
+		 entry->file.path);
+	log_summary(i + 1,where);
+	tLogEntry = savedLog;
+	return;
+}
+
+/*
+ *	With --jobs,entries run in parallel on the pool. An entry waits for
+ *	the closest entry before it at the same or a parent path,so a
+ *	directory is created (or cleaned) before anything inside it,entries
+ *	for one path keep their order,and unrelated subtrees do not wait for
+ *	each other. A pattern is placed at its directory without wildcards,
+ *	as it may match anything inside,so it runs before entries there.
+ */
+typedef struct Plan_Node {
+	size_t idx;
+	const char *key;
+	size_t keyLen;
+	struct Plan_Node *child,*sibling;	// Entries waiting for it
+} Plan_Node;
+
+static struct {
+	atomic_size_t left;
+	atomic_bool done;
+} gSchedule;
+
+static int plan_node_cmp(const void *pa,const void *pb)
+{
+	const Plan_Node *a = pa,*b = pb;
+	for (size_t i = 0;;i++) {
+		int ca = i < a->keyLen ? a->key[i] == '/' ? 1 :
+					 (unsigned char)a->key[i] : 0;
+		int cb = i < b->keyLen ? b->key[i] == '/' ? 1 :
+					 (unsigned char)b->key[i] : 0;
+		if (ca != cb)
+			return ca - cb;
+		if (!ca)
+			break;
+	}
+	return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+// Whether the key of a is the same as or a parent of that of b
+static bool plan_node_covers(const Plan_Node *a,const Plan_Node *b)
+{
+	return !a->keyLen						||
+	       (a->keyLen <= b->keyLen				&&
+		!memcmp(a->key,b->key,a->keyLen)			&&
+		(a->keyLen == b->keyLen || b->key[a->keyLen] == '/'	||
+		 a->key[a->keyLen - 1] == '/'));
+}
+
+static void plan_node_task(void *arg)
+{
+	Plan_Node *node = arg;
+
+	Entry_Stats *savedStats = tEntryStats;
+	plan_run_entry(node->idx);
+	tEntryStats = savedStats;
+
+	for (Plan_Node *child = node->child;child;child = child->sibling)
+		pool_submit(plan_node_task,child);
+
+	if (atomic_fetch_sub(&gSchedule.left,1) == 1) {
+		atomic_store(&gSchedule.done,true);
+		pool_wakeup();
+	}
+	return;
+}
+
+static void plan_schedule(void)
+{
+	Plan_Node *nodes = malloc(sizeof(Plan_Node) * (gPlan.num + 1));
+	Plan_Node **stack = malloc(sizeof(Plan_Node*) * (gPlan.num + 1));
+	check(nodes && stack,"Cannot allocate memory for scheduling\n");
+
+	size_t num = 0;
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+		if (!plan_entry_attr(entry))
+			continue;
+
+		const char *path = entry->file.path;
+		size_t keyLen = strlen(path);
+		if ((entry->file.attr & ATTR_GLOB) &&
+		    path[strcspn(path,"*?[")]) {
+			keyLen = strcspn(path,"*?[");
+			while (keyLen && path[keyLen] != '/')
+				keyLen--;
+			keyLen += !keyLen && path[0] == '/';	// "/"
+		}
+		nodes[num++] = (Plan_Node) {
+					.idx	= i,
+					.key	= path,
+					.keyLen	= keyLen,
+			       };
+	}
+	qsort(nodes,num,sizeof(Plan_Node),plan_node_cmp);
+
+	Plan_Node *roots = NULL;
+	size_t depth = 0;
+	for (size_t i = 0;i < num;i++) {
+		Plan_Node *node = &nodes[i];
+		while (depth && !plan_node_covers(stack[depth - 1],node))
+			depth--;
+
+		Plan_Node **list = depth ? &stack[depth - 1]->child : &roots;
+		node->sibling	= *list;
+		*list		= node;
+		stack[depth++]	= node;
+	}
+	free(stack);
+
+	atomic_store(&gSchedule.left,num);
+	atomic_store(&gSchedule.done,!num);
+	for (Plan_Node *node = roots,*next;node;node = next) {
+		next = node->sibling;
+		pool_submit(plan_node_task,node);
+	}
+	pool_wait(&gSchedule.done);
+
+	free(nodes);
+	return;
+}
+
+/*
+ *	With --create-first,cleaning and removals are deferred until
+ *	everything is created,except removals with entries inside them,
+ *	which must not undo what is created. Things created are too new to be
+ *	cleaned.
+ */
+static void plan_split(void)
+{
+	const Entry_Attribute creating = ATTR_CREATE | ATTR_APPEND |
+					 ATTR_CREATEDIR | ATTR_WRITE;
+	const Entry_Attribute removing = ATTR_REMOVE | ATTR_RECUR;
+
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+		entry->deferred = entry->in.attr & (ATTR_CLEAN | removing);
+		if (entry->removed || !(entry->in.attr & removing))
+			continue;
+
+		// Entries inside the path,or the directory of a pattern
+		const char *path = entry->file.path;
+		size_t length = strlen(path);
+		if (entry->file.attr & ATTR_GLOB) {
+			length = strcspn(path,"*?[");
+			while (length && path[length] != '/')
+				length--;
+		}
+
+		for (size_t j = i + 1;j < gPlan.num;j++) {
+			Plan_Entry *next = &gPlan.entries[j];
+			if (strncmp(next->file.path,path,length))
+				break;
+			if (!next->removed && (next->in.attr & creating)) {
+				entry->deferred &= ~removing;
+				break;
+			}
+		}
+	}
+	return;
+}
+
+static void plan_run(void)
+{
+	if (gPool.workerNum) {
+		plan_schedule();
+	} else {
+		for (size_t i = 0;i < gPlan.num;i++) {
+			if (plan_entry_attr(&gPlan.entries[i]))
+				plan_run_entry(i);
+		}
+	}
+	return;
+}
+
+/*
+ *	Readiness is reported to the file descriptor of --ready-fd (closed
+ *	then),the socket in $NOTIFY_SOCKET,as sd_notify() does,and by
+ *	creating the file of --ready-file. It is only reported if asked for
+ *	with one of them or --create-first,and never in a dry run.
+ */
+static bool ready_requested(void)
+{
+	return !gArg.dryRun && (gArg.createFirst || gArg.readyFd >= 0 ||
+				gArg.readyFile);
+}
+
+static void notify_ready(void)
+{
+	const char *msg = "READY=1\n";
+	if (!ready_requested())
+		return;
+
+	if (gArg.readyFd >= 0) {
+		if (!write_all(gArg.readyFd,msg,strlen(msg)))
+			log_errno(LOG_WARNING,errno,
+				  "Cannot report readiness to fd %d\n",
+				  gArg.readyFd);
+		close(gArg.readyFd);
+	}
+
+	const char *socketPath = getenv("NOTIFY_SOCKET");
+	if (socketPath && (socketPath[0] == '/' || socketPath[0] == '@')) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		size_t length = strlen(socketPath);
+		int fd = socket(AF_UNIX,SOCK_DGRAM | SOCK_CLOEXEC,0);
+		if (length < sizeof(addr.sun_path) && fd >= 0) {
+			memcpy(addr.sun_path,socketPath,length);
+			if (addr.sun_path[0] == '@')		// Abstract
+				addr.sun_path[0] = '\0';
+			if (sendto(fd,msg,strlen(msg) - 1,MSG_NOSIGNAL,
+				   (struct sockaddr*)&addr,
+				   offsetof(struct sockaddr_un,sun_path) +
+				   length) < 0)
+				log_errno(LOG_WARNING,errno,
+					  "Cannot notify %s\n",socketPath);
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (gArg.readyFile) {
+		int fd = open(gArg.readyFile,O_WRONLY | O_CREAT | O_CLOEXEC,
+			      0644);
+		if (fd < 0)
+			log_errno(LOG_WARNING,errno,"Cannot create %s\n",
+				  gArg.readyFile);
+		else
+			close(fd);
+	}
+	return;
+}
+
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+
+// Threads created later inherit both
+static void lower_priority(void)
+{
+	struct sched_param param = { 0 };
+	if (sched_setscheduler(0,SCHED_IDLE,&param))
+		log_errno(LOG_INFO,errno,"Cannot switch to SCHED_IDLE\n");
+	if (syscall(SYS_ioprio_set,IOPRIO_WHO_PROCESS,0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+		log_errno(LOG_INFO,errno,"Cannot set I/O priority to idle\n");
+	return;
+}
+
+static void plan_execute(void)
+{
+	if (gArg.stats) {
+		gStats.entries = calloc(gPlan.num,sizeof(Entry_Stats));
+		check(gStats.entries,"Cannot allocate memory for statistics\n");
+	}
+
+	pool_start(gArg.jobs);
+	if (gArg.createFirst) {
+		plan_split();
+		gPlan.phase = PHASE_CREATE;
+	}
+	plan_run();
+	notify_ready();
+
+	// Clean and remove in the background
+	if (gArg.createFirst) {
+		pool_stop();
+		lower_priority();
+		pool_start(gArg.jobs);
+
+		gPlan.phase = PHASE_DEFERRED;
+		plan_run();
+	}
+	pool_stop();
+	tEntryStats = NULL;
+
+	return;
+}
+
+static void plan_free(void)
+{
+	free(gStats.entries);
+	free(gPlan.entries);
+	arena_free(&gArena);
+	if (gPlan.cacheMap)
+		munmap(gPlan.cacheMap,gPlan.cacheSize);
+	return;
+}
+
+/*
+ *	Interpret a C-style escape sequence after the backslash at *p,
+ *	*p is moved to the end of it
+ */
+static char unescape_char(char **p)
+{
+	char *s = *p;
+	char c = *s++;
+
+	switch (c) {
+	case 'a':	c = '\a';	break;
+	case 'b':	c = '\b';	break;
+	case 'f':	c = '\f';	break;
+	case 'n':	c = '\n';	break;
+	case 'r':	c = '\r';	break;
+	case 't':	c = '\t';	break;
+	case 'v':	c = '\v';	break;
+	case 'x':
+		c = 0;
+		for (int i = 0;i < 2 && isxdigit((unsigned char)*s);i++,s++)
+			c = c * 16 + (isdigit((unsigned char)*s) ? *s - '0' :
+					(tolower((unsigned char)*s) - 'a' + 10));
+		break;
+	default:
+		if (c >= '0' && c <= '7') {
+			c -= '0';
+			for (int i = 0;i < 2 && *s >= '0' && *s <= '7';i++,s++)
+				c = c * 8 + *s - '0';
+		}
+		break;
+	}
+
+	*p = s;
+	return c;
+}
+
+/*
+ *	Split a field at *p in place,removing quotes and interpreting
+ *	escapes. Returns NULL if there is no more field.
+ */
+static char *next_field(char **p,bool *bad)
+{
+	char *r = skip_space(*p),*w = r,*field = r;
+	if (!*r)
+		return NULL;
+
+	char quote = 0;
+	while (*r && (quote || (*r != ' ' && *r != '\t'))) {
+		if (!quote && (*r == '"' || *r == '\'')) {
+			quote = *r++;
+		} else if (quote && *r == quote) {
+			quote = 0;
+			r++;
+		} else if (*r == '\\' && r[1] && quote != '\'') {
+			r++;
+			*w++ = unescape_char(&r);
+		} else {
+			*w++ = *r++;
+		}
+	}
+
+	if (quote)
+		*bad = true;
+
+	bool more = *r;
+	*w = '\0';
+	*p = more ? r + 1 : r;
+	return field;
+}
+
+static void unescape(char *s)
+{
+	char *w = s;
+	while (*s) {
+		if (*s == '\\' && s[1]) {
+			s++;
+			*w++ = unescape_char(&s);
+		} else {
+			*w++ = *s++;
+		}
+	}
+	*w = '\0';
+	return;
+}
+
+/*
+ *	buf holds the whole file and is split in place,the plan refers to
+ *	it directly,so it must be kept until the plan is freed.
+ */
+static void parse_conf(char *buf,const char *source)
+{
+	static Entry_Attribute attrTableSet[256] = {
+			['w']	= ATTR_WRITE,
+			['f']	= ATTR_CREATE | ATTR_WRITE | ATTR_OWNERSHIP |
+				  ATTR_PERM,
+			['d']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
+				  ATTR_CLEAN,
+			['!']	= ATTR_ONBOOT,
+			['r']	= ATTR_REMOVE | ATTR_GLOB,
+			['R']	= ATTR_RECUR | ATTR_GLOB,
+			['D']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
+				  ATTR_CLEAN | ATTR_REMOVE,
+			['q']	= ATTR_SUBVOL | ATTR_CREATEDIR | ATTR_OWNERSHIP |
+				  ATTR_PERM | ATTR_CLEAN,
+			['Q']	= ATTR_SUBVOL | ATTR_CREATEDIR | ATTR_OWNERSHIP |
+				  ATTR_PERM | ATTR_CLEAN | ATTR_REMOVE,
+			['v']	= ATTR_SUBVOL | ATTR_CREATEDIR | ATTR_OWNERSHIP |
+				  ATTR_PERM | ATTR_CLEAN,
+			['h']	= ATTR_ATTR | ATTR_GLOB,
+			['H']	= ATTR_ATTRTREE | ATTR_GLOB,
+			['x']	= ATTR_EXCLUDE,
+			['+']	= ATTR_APPEND,
+		};
+	static Entry_Attribute attrTableClear[256] = {
+			['+']	= ATTR_WRITE,
+		};
+
+	unsigned int lineNo = 0;
+	for (char *line = buf,*next;line;line = next) {
+		lineNo++;
+		next = strchr(line,'\n');
+		if (next)
+			*next++ = '\0';
+
+		size_t length = strlen(line);
+		while (length && isspace((unsigned char)line[length - 1]))
+			line[--length] = '\0';
+
+		char *p = skip_space(line);
+		if (!*p || *p == '#')		// Empty line or comment
+			continue;
+
+		bool bad = false;
+		char *fields[6];
+		for (int i = 0;i < 6;i++) {
+			fields[i] = next_field(&p,&bad);
+			if (!fields[i]) {
+				for (;i < 6;i++)
+					fields[i] = "";
+			}
+		}
+		char *arg = skip_space(p);
+		unescape(arg);
+
+		if (bad || !fields[1][0]) {
+			log_warn("%s:%u: Invalid line,ignored\n",
+				 source,lineNo);
+			continue;
+		}
+
+		Entry_Attribute attr = 0x00;
+		for (const char *t = fields[0];*t;t++) {
+			if (!attrTableSet[(unsigned char)*t])
+				log_warn("%s:%u: Invalid type %c\n",
+					 source,lineNo,*t);
+			attr |= attrTableSet[(unsigned char)*t];
+			attr &= ~attrTableClear[(unsigned char)*t];
+		}
+		// f+ truncates and writes like f
+		if ((attr & ATTR_CREATE) && (attr & ATTR_APPEND))
+			attr = (attr & ~ATTR_APPEND) | ATTR_WRITE;
+
+		Plan_Entry *entry = plan_add();
+		entry->file = (File_Entry) {
+					.path	= fields[1],
+					.attr	= attr,
+				       };
+		entry->in = (Process_File_In) {
+					.attr		= attr & ~ATTR_ONBOOT &
+							  ~ATTR_GLOB,
+					.type		= fields[0][0],
+					.modeStr	= fields[2],
+					.userName	= fields[3],
+					.grpName	= fields[4],
+					.ageStr		= fields[5],
+					.arg		= arg,
+				     };
+		entry->source	= source;
+		entry->line	= lineNo;
+	}
+
+	return;
+}
+
+/*
+ *	Read the whole file into the arena,terminated with '\0'. The buffer
+ *	it is read into first is charged as well.
+ */
+static char *read_file(int fd,const char *path)
+{
+	struct stat st;
+	if (fstat(fd,&st)) {
+		log_errno(LOG_WARNING,errno,
+			  "Cannot get the status of file %s\n",path);
+		return NULL;
+	}
+
+	size_t size = S_ISREG(st.st_mode) ? (size_t)st.st_size + 1 : 4096;
+	memory_charge(size);
+	char *buf = malloc(size);
+	check(buf,"Cannot allocate memory for file %s\n",path);
+
+	size_t length = 0;
+	while (true) {
+		if (length + 1 == size) {
+			memory_charge(size);
+			char *t = realloc(buf,size * 2);
+			check(t,"Cannot allocate memory for file %s\n",path);
+			buf = t;
+			size *= 2;
+		}
+
+		ssize_t ret = read(fd,buf + length,size - length - 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			log_errno(LOG_WARNING,errno,"Cannot read file %s\n",
+				  path);
+			memory_uncharge(size);
+			free(buf);
+			return NULL;
+		}
+		if (!ret)
+			break;
+		length += ret;
+	}
+
+	char *content = arena_alloc(&gArena,length + 1);
+	memcpy(content,buf,length);
+	content[length] = '\0';
+	memory_uncharge(size);
+	free(buf);
+
+	return content;
+}
+
+/*
+ *	Sources of the plan: configuration files and the directories
+ *	holding them,recorded for validating the cache
+ */
+enum {
+	SOURCE_DIR,
+	SOURCE_FILE,			// Found in a directory
+	SOURCE_ARG,			// Given on the command line
+};
+
+typedef struct {
+	const char *path;
+	int kind;
+	bool exists;
+	struct stat st;
+} Conf_Source;
+
+static struct {
+	Conf_Source *list;
+	size_t num,cap;
+} gSources;
+
+static void conf_add_source(const char *path,int kind,const struct stat *st)
+{
+	if (!gArg.cachePath)
+		return;
+
+	if (gSources.num == gSources.cap) {
+		size_t cap = gSources.cap ? gSources.cap * 2 : 32;
+		Conf_Source *list = realloc(gSources.list,
+					    sizeof(Conf_Source) * cap);
+		check(list,"Cannot allocate memory for %s\n",path);
+		gSources.list	= list;
+		gSources.cap	= cap;
+	}
+
+	Conf_Source *source = &gSources.list[gSources.num++];
+	source->path	= arena_strdup(&gArena,path);
+	source->kind	= kind;
+	source->exists	= st;
+	if (st)
+		source->st = *st;
+	return;
+}
+
+/*
+ *	Roots (--root)
+ *	Configuration files are read from every root,and those with the same
+ *	content are parsed only once. They are opened with their paths resolved
+ *	inside the root. Each root is then processed by a child process
+ *	chrooted into it,so absolute paths and symbolic links resolve inside
+ *	the root as well,up to --jobs of them at a time.
+ */
+typedef struct {
+	unsigned int hash;
+	const char *content;		// Copy before parsing
+	size_t first,num;		// Entries parsed from it
+} Conf_Text;
+
+typedef struct {
+	size_t text;
+	const char *path;
+} Root_Conf;
+
+typedef struct {
+	const char *path;
+	Root_Conf *confs;
+	size_t confNum,confCap;
+	pid_t pid;
+} Root;
+
+static struct {
+	Root *list;
+	size_t num;
+	Root *current;			// Root whose files are being read
+	int fd;				// Of the current root
+	Conf_Text *texts;
+	size_t textNum,textCap;
+} gRoots;
+
+static void root_conf_add(const char *path,char *content)
+{
+	unsigned int hash = hash_string(content);
+	size_t i;
+	for (i = 0;i < gRoots.textNum;i++) {
+		if (gRoots.texts[i].hash == hash &&
+		    !strcmp(gRoots.texts[i].content,content))
+			break;
+	}
+
+	const char *source = arena_strdup(&gArena,path);
+	if (i == gRoots.textNum) {
+		if (gRoots.textNum == gRoots.textCap) {
+			gRoots.textCap = gRoots.textCap ? gRoots.textCap * 2 :
+							  32;
+			gRoots.texts = realloc(gRoots.texts,sizeof(Conf_Text) *
+							    gRoots.textCap);
+			check(gRoots.texts,
+			      "Cannot allocate memory for %s\n",path);
+		}
+
+		Conf_Text *text = &gRoots.texts[gRoots.textNum++];
+		text->hash	= hash;
+		text->content	= arena_strdup(&gArena,content);
+		text->first	= gPlan.num;
+		parse_conf(content,source);
+		text->num	= gPlan.num - text->first;
+	}
+
+	Root *root = gRoots.current;
+	if (root->confNum == root->confCap) {
+		root->confCap = root->confCap ? root->confCap * 2 : 32;
+		root->confs = realloc(root->confs,
+				      sizeof(Root_Conf) * root->confCap);
+		check(root->confs,"Cannot allocate memory for %s\n",path);
+	}
+	root->confs[root->confNum++] = (Root_Conf) {
+						.text	= i,
+						.path	= source,
+					   };
+	return;
+}
+
+/*
+ *	Without openat2(),resolve path component by component. Symbolic links
+ *	are read and followed from the root if absolute,and ".." never goes
+ *	above it. Every component resolved is a real one,so the path that is
+ *	opened at last contains no symbolic links.
+ */
+static int root_open_walk(int rootFd,const char *path,int flags)
+{
+	char cur[PATH_MAX] = "",rest[PATH_MAX];
+	snprintf(rest,sizeof(rest),"%s",path);
+	size_t curLen = 0;
+	int links = 0;
+
+	char *p = rest;
+	while (*p) {
+		char *name = p;
+		p += strcspn(p,"/");
+		if (*p)
+			*p++ = '\0';
+
+		if (!name[0] || !strcmp(name,"."))
+			continue;
+		if (!strcmp(name,"..")) {
+			while (curLen && cur[curLen - 1] != '/')
+				curLen--;
+			if (curLen)
+				curLen--;
+			cur[curLen] = '\0';
+			continue;
+		}
+
+		size_t nameLen = strlen(name);
+		if (curLen + nameLen + 2 > sizeof(cur)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		size_t oldLen = curLen;
+		if (curLen)
+			cur[curLen++] = '/';
+		memcpy(cur + curLen,name,nameLen + 1);
+		curLen += nameLen;
+
+		struct stat st;
+		if (fstatat(rootFd,cur,&st,AT_SYMLINK_NOFOLLOW))
+			return -1;
+		if (!S_ISLNK(st.st_mode))
+			continue;
+
+		if (++links > 40) {
+			errno = ELOOP;
+			return -1;
+		}
+		char target[PATH_MAX];
+		ssize_t size = readlinkat(rootFd,cur,target,sizeof(target) - 1);
+		if (size < 0)
+			return -1;
+		target[size] = '\0';
+
+		// Replace the link with its target,in front of what is left
+		char next[PATH_MAX];
+		if ((size_t)snprintf(next,sizeof(next),"%s/%s",target,p) >=
+		    sizeof(next)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(rest,next,strlen(next) + 1);
+		p = rest;
+		curLen = target[0] == '/' ? 0 : oldLen;
+		cur[curLen] = '\0';
+	}
+
+	return openat(rootFd,curLen ? cur : ".",flags | O_NOFOLLOW);
+}
+
+// Open path as if chrooted into the root at rootFd
+static int root_open(int rootFd,const char *path,int flags)
+{
+#ifdef HAVE_OPENAT2
+	struct open_how how = {
+				.flags		= flags,
+				.resolve	= RESOLVE_IN_ROOT,
+			      };
+	int fd = syscall(SYS_openat2,rootFd,path,&how,sizeof(how));
+	if (fd >= 0 || (errno != ENOSYS && errno != EPERM))
+		return fd;
+#endif
+	return root_open_walk(rootFd,path,flags);
+}
+
+/*
+ *	Files given on the command line are opened as usual,others of a root
+ *	inside it
+ */
+static void read_conf(const char *path,int kind)
+{
+	int fd = gRoots.current && kind != SOURCE_ARG ?
+		 root_open(gRoots.fd,path + strlen(gRoots.current->path),
+			   O_RDONLY | O_CLOEXEC) :
+		 open(path,O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(LOG_WARNING,errno,
+			  "Cannot open configuration file %s\n",path);
+		conf_add_source(path,kind,NULL);
+		return;
+	}
+
+	struct stat st;
+	if (!fstat(fd,&st))
+		conf_add_source(path,kind,&st);
+
+	char *content = read_file(fd,path);
+	close(fd);
+
+	if (content && gRoots.current)
+		root_conf_add(path,content);
+	else if (content)
+		parse_conf(content,arena_strdup(&gArena,path));
+	return;
+}
+
+/*
+ *	Files in configuration directories are indexed by their paths relative
+ *	to the directory. As systemd-tmpfiles does,a file in /etc/tmpfiles.d
+ *	masks the one with the same name in /lib/tmpfiles.d,which is never
+ *	opened,and files are read in the order of their names.
+ */
+#define FRAGMENT_HASH_SIZE	256
+
+typedef struct Conf_Fragment {
+	const char *name;
+	const char *path;
+	unsigned int hash;
+	struct Conf_Fragment *next;		// In the same bucket
+} Conf_Fragment;
+
+static struct {
+	Conf_Fragment *buckets[FRAGMENT_HASH_SIZE];
+	size_t num;
+} gFragments;
+
+static void fragment_add(const Walk_Entry *entry,void *ctx)
+{
+	if (entry->isDir) {
+		struct stat st;
+		bool ok = !fstatat(entry->dirFd,entry->name,&st,0);
+		conf_add_source(entry->path,SOURCE_DIR,ok ? &st : NULL);
+		return;
+	}
+
+	const char *name = entry->path + *(size_t*)ctx;
+	unsigned int hash = hash_string(name);
+	Conf_Fragment **bucket = &gFragments.buckets[hash % FRAGMENT_HASH_SIZE];
+	for (Conf_Fragment *f = *bucket;f;f = f->next) {
+		if (f->hash == hash && !strcmp(f->name,name)) {
+			log_info("%s is masked by %s\n",entry->path,f->path);
+			return;
+		}
+	}
+
+	Conf_Fragment *f = arena_alloc(&gArena,sizeof(Conf_Fragment));
+	f->path	= arena_strdup(&gArena,entry->path);
+	f->name	= f->path + (name - entry->path);
+	f->hash	= hash;
+	f->next	= *bucket;
+	*bucket	= f;
+	gFragments.num++;
+	return;
+}
+
+static int fragment_cmp(const void *pa,const void *pb)
+{
+	const Conf_Fragment *a = *(Conf_Fragment**)pa;
+	const Conf_Fragment *b = *(Conf_Fragment**)pb;
+	return strcmp(a->name,b->name);
+}
+
+// Directories come in the order of priority
+static void read_conf_dirs(const char *const *dirs,int dirNum)
+{
+	for (int i = 0;i < dirNum;i++) {
+		int fd = gRoots.current ?
+			 root_open(gRoots.fd,dirs[i] + strlen(gRoots.current->path),
+				   O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+			 open(dirs[i],O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat st;
+		bool ok = fd >= 0 && !fstat(fd,&st);
+		conf_add_source(dirs[i],SOURCE_DIR,ok ? &st : NULL);
+
+		size_t prefix = strlen(dirs[i]) + 1;
+		if (ok)
+			iterate_directory_at(fd,dirs[i],fragment_add,NULL,NULL,
+					     &prefix,WALK_RECURSIVE,NULL);
+		else if (fd >= 0)
+			close(fd);
+		else if (errno != ENOENT)
+			log_errno(LOG_WARNING,errno,
+				  "Cannot open directory %s\n",dirs[i]);
+	}
+
+	Conf_Fragment **list = malloc(sizeof(*list) * (gFragments.num + 1));
+	check(list,"Cannot allocate memory for configuration files\n");
+	size_t num = 0;
+	for (size_t i = 0;i < FRAGMENT_HASH_SIZE;i++) {
+		for (Conf_Fragment *f = gFragments.buckets[i];f;f = f->next)
+			list[num++] = f;
+	}
+	qsort(list,num,sizeof(*list),fragment_cmp);
+
+	for (size_t i = 0;i < num;i++)
+		read_conf(list[i]->path,SOURCE_FILE);
+
+	free(list);
+	memset(&gFragments,0,sizeof(gFragments));
+	return;
+}
+
+static void metrics_add(Metrics *sum,const Metrics *m)
+{
+	for (int i = 0;i < METRICS_TYPE_NUM;i++)
+		sum->files[i] += m->files[i];
+	for (int i = 0;i < METRICS_ERRNO_NUM;i++)
+		sum->errors[i] += m->errors[i];
+	sum->removed	+= m->removed;
+	sum->reclaimed	+= m->reclaimed;
+	sum->globNs	+= m->globNs;
+	sum->walkNs	+= m->walkNs;
+	sum->parseNs	+= m->parseNs;
+	sum->executeNs	+= m->executeNs;
+	return;
+}
+
+/*
+ *	Write the metrics in the text format of Prometheus,for the textfile
+ *	collector of node_exporter. Values are of this run only,so they are
+ *	all gauges. The file is replaced atomically.
+ */
+static void metrics_write(const Metrics *sum)
+{
+	char tmpName[PATH_MAX];
+	snprintf(tmpName,sizeof(tmpName),"%s.%ld",gMetrics.name,
+		 (long int)getpid());
+	int fd = openat(gMetrics.dirFd,tmpName,O_WRONLY | O_CREAT | O_EXCL |
+			O_NOFOLLOW | O_CLOEXEC,0644);
+	FILE *fp = fd >= 0 ? fdopen(fd,"w") : NULL;
+	if (!fp) {
+		log_errno(LOG_WARNING,errno,
+			  "Cannot create metrics file %s.%ld\n",gMetrics.path,
+			  (long int)getpid());
+		if (fd >= 0) {
+			close(fd);
+			unlinkat(gMetrics.dirFd,tmpName,0);
+		}
+		return;
+	}
+
+	fputs("# HELP pawprint_files_processed Paths processed,by type of "
+	      "the entry.\n# TYPE pawprint_files_processed gauge\n",fp);
+	for (int i = 0;i < METRICS_TYPE_NUM;i++) {
+		if (sum->files[i] && isalpha(i))
+			fprintf(fp,"pawprint_files_processed{type=\"%c\"} %ld\n",
+				i,sum->files[i]);
+	}
+	fprintf(fp,"# HELP pawprint_files_removed Files and directories "
+		"removed.\n# TYPE pawprint_files_removed gauge\n"
+		"pawprint_files_removed %ld\n",sum->removed);
+	fprintf(fp,"# HELP pawprint_clean_reclaimed_bytes Space freed by "
+		"cleaning.\n# TYPE pawprint_clean_reclaimed_bytes gauge\n"
+		"pawprint_clean_reclaimed_bytes %llu\n",
+		(unsigned long long int)sum->reclaimed);
+
+	fputs("# HELP pawprint_errors Failed operations,by errno.\n"
+	      "# TYPE pawprint_errors gauge\n",fp);
+	for (int i = 1;i < METRICS_ERRNO_NUM;i++) {
+		if (sum->errors[i])
+			fprintf(fp,"pawprint_errors{errno=\"%d\"} %ld\n",i,
+				sum->errors[i]);
+	}
+	if (sum->errors[0])
+		fprintf(fp,"pawprint_errors{errno=\"other\"} %ld\n",
+			sum->errors[0]);
+
+	// Walks of parallel entries overlap,so walk may exceed execute
+	fputs("# HELP pawprint_phase_seconds Time spent,by phase.\n"
+	      "# TYPE pawprint_phase_seconds gauge\n",fp);
+	fprintf(fp,"pawprint_phase_seconds{phase=\"parse\"} %.6f\n",
+		sum->parseNs / 1e9);
+	fprintf(fp,"pawprint_phase_seconds{phase=\"glob\"} %.6f\n",
+		sum->globNs / 1e9);
+	fprintf(fp,"pawprint_phase_seconds{phase=\"walk\"} %.6f\n",
+		sum->walkNs / 1e9);
+	fprintf(fp,"pawprint_phase_seconds{phase=\"execute\"} %.6f\n",
+		sum->executeNs / 1e9);
+
+	fprintf(fp,"# HELP pawprint_last_run_timestamp_seconds When the run "
+		"finished.\n# TYPE pawprint_last_run_timestamp_seconds "
+		"gauge\npawprint_last_run_timestamp_seconds %lld\n",
+		(long long int)time(NULL));
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) || !ok ||
+	    renameat(gMetrics.dirFd,tmpName,gMetrics.dirFd,gMetrics.name)) {
+		log_errno(LOG_WARNING,errno,"Cannot write metrics file %s\n",
+			  gMetrics.path);
+		unlinkat(gMetrics.dirFd,tmpName,0);
+	}
+	return;
+}
+
+// Workers of several roots leave the sum to the parent
+static void metrics_save(void)
+{
+	Metrics sum = {
+			.parseNs	= gStats.parseNs,
+			.executeNs	= gStats.executeNs,
+		      };
+	for (Metrics *m = gMetrics.list;m;m = m->next)
+		metrics_add(&sum,m);
+
+	if (gMetrics.slot)
+		*gMetrics.slot = sum;
+	else
+		metrics_write(&sum);
+	return;
+}
+
+/*
+ *	Read configuration files of every root. Files given on the command line
+ *	are shared by all roots.
+ */
+static void roots_read(const char *const *confs,int confNum)
+{
+	for (size_t i = 0;i < gRoots.num;i++) {
+		gRoots.current = &gRoots.list[i];
+		gRoots.fd = open(gRoots.current->path,
+				 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (gRoots.fd < 0)
+			log_errno(LOG_WARNING,errno,"Cannot open root %s\n",
+				  gRoots.current->path);
+		else if (!gArg.noDefault) {
+			char etc[PATH_MAX],lib[PATH_MAX];
+			snprintf(etc,sizeof(etc),"%s/etc/tmpfiles.d",
+				 gRoots.current->path);
+			snprintf(lib,sizeof(lib),"%s/lib/tmpfiles.d",
+				 gRoots.current->path);
+			read_conf_dirs((const char *[]) { etc,lib },2);
+		}
+
+		for (int j = 0;j < confNum;j++)
+			read_conf(confs[j],SOURCE_ARG);
+		if (gRoots.fd >= 0)
+			close(gRoots.fd);
+	}
+	gRoots.current = NULL;
+	return;
+}
+
+// Keep entries of the root only,in the order its files were read
+static void root_enter(Root *root,int jobs)
+{
+	size_t num = 0;
+	for (size_t i = 0;i < root->confNum;i++)
+		num += gRoots.texts[root->confs[i].text].num;
+
+	memory_charge(sizeof(Plan_Entry) * (num + 1));
+	Plan_Entry *entries = malloc(sizeof(Plan_Entry) * (num + 1));
+	check(entries,"Cannot allocate memory for entries\n");
+
+	num = 0;
+	for (size_t i = 0;i < root->confNum;i++) {
+		Conf_Text *text = &gRoots.texts[root->confs[i].text];
+		for (size_t j = text->first;j < text->first + text->num;j++) {
+			entries[num]		= gPlan.entries[j];
+			entries[num].source	= root->confs[i].path;
+			entries[num].seq	= num;
+			num++;
+		}
+	}
+	memory_uncharge(sizeof(Plan_Entry) * gPlan.cap);
+	free(gPlan.entries);
+	gPlan.entries	= entries;
+	gPlan.num	= num;
+	gPlan.cap	= num + 1;
+
+	check_errno(!chroot(root->path) && !chdir("/"),
+		    "Cannot change root to %s\n",root->path);
+	log_info("Processing root %s\n",root->path);
+	gArg.jobs	= jobs;
+	return;
+}
+
+/*
+ *	Fork a worker for every root. Returns in the workers only,which go on
+ *	processing their root. A single root is processed without forking,
+ *	unless readiness is reported by a path,which is outside the root.
+ */
+static void roots_run(void)
+{
+	const char *socketPath = getenv("NOTIFY_SOCKET");
+	bool readyByPath = ready_requested() &&
+			   (gArg.readyFile || (socketPath && socketPath[0] == '/'));
+	if (gRoots.num == 1 && !readyByPath) {
+		root_enter(&gRoots.list[0],gArg.jobs > 1 ? gArg.jobs : 1);
+		return;
+	}
+
+	size_t workers = gArg.jobs > 1 ? (size_t)gArg.jobs : 1;
+	if (workers > gRoots.num || gArg.watch)	// --watch never finishes
+		workers = gRoots.num;
+	int jobs = gArg.jobs / (int)workers;
+
+	fflush(stdout);
+	log_flush();
+
+	if (gMetrics.path) {
+		gMetrics.slots = mmap(NULL,sizeof(Metrics) * gRoots.num,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_ANONYMOUS,-1,0);
+		check(gMetrics.slots != MAP_FAILED,
+		      "Cannot allocate memory for metrics\n");
+	}
+
+	bool failed = false;
+	size_t running = 0;
+	for (size_t i = 0;i < gRoots.num || running;) {
+		if (i < gRoots.num && running < workers) {
+			pid_t pid = fork();
+			check_errno(pid >= 0,"Cannot fork for root %s\n",
+				    gRoots.list[i].path);
+			if (!pid) {
+				// Reported by the parent once every root is done
+				if (gArg.readyFd >= 0)
+					close(gArg.readyFd);
+				gArg.readyFd	= -1;
+				gArg.readyFile	= NULL;
+				unsetenv("NOTIFY_SOCKET");
+				if (gMetrics.path)
+					gMetrics.slot = &gMetrics.slots[i];
+				root_enter(&gRoots.list[i],jobs > 1 ? jobs : 1);
+				return;
+			}
+			gRoots.list[i].pid = pid;
+			running++;
+			i++;
+			continue;
+		}
 
-	unsigned long int mask = 0;
-	for (int i = 1;attr[i];i++) {
-		if (!flags[(int)attr[i]]) {
-			log_warn("Invalid file attribute %c\n",attr[i]);
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		check_errno(pid >= 0,"Cannot wait for workers\n");
+		running--;
+
+		if (WIFEXITED(status) && !WEXITSTATUS(status))
+			continue;
+		for (size_t j = 0;j < i;j++) {
+			if (gRoots.list[j].pid == pid)
+				log_warn("Failed to process root %s\n",
+					 gRoots.list[j].path);
 		}
-		mask |= flags[(int)attr[i]];
+		failed = true;
 	}
 
-	mask = type ? mask : ~mask;
+	if (gMetrics.path) {
+		Metrics sum = { 0 };
+		for (size_t i = 0;i < gRoots.num;i++)
+			metrics_add(&sum,&gMetrics.slots[i]);
+		metrics_write(&sum);
+	}
 
-	int origin;
-	int fd = open(path,O_RDONLY);
-	if (fd < 0) {
-		log_warn("Cannot open file %s\n",path);
-		return;
+	notify_ready();
+	exit(failed ? 1 : 0);
+}
+
+/*
+ *	Plan cache (--cache)
+ *	The parsed plan is saved as a flat file with sources,entries and a
+ *	string table,which is mapped and used directly in later runs. It is
+ *	valid if every source still has the same inode,size and times,
+ *	a new or removed file changes the time of its directory.
+ *	Options affecting execution are applied in plan_resolve(),so the
+ *	cache does not depend on them.
+ */
+#define CACHE_MAGIC		"PAWPLAN"
+#define CACHE_VERSION		3
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t sourceNum;
+	uint32_t entryNum;
+	uint32_t strSize;
+} Cache_Header;
+
+typedef struct {
+	uint64_t dev,ino,size;
+	int64_t mtimeSec,mtimeNsec,ctimeSec,ctimeNsec;
+	uint32_t path;
+	uint32_t kind;
+	uint32_t exists;
+	uint32_t padding;
+} Cache_Source;
+
+typedef struct {
+	uint32_t attr;
+	uint32_t path,mode,user,group,age,arg;
+	uint32_t source,line;
+	uint32_t type;
+} Cache_Entry;
+
+typedef struct {
+	char *buf;
+	size_t length,cap;
+	uint32_t *slots;		// Offsets plus one,for deduplication
+	size_t slotNum,used;
+} Str_Table;
+
+static uint32_t str_table_add(Str_Table *table,const char *s)
+{
+	if (table->used * 2 >= table->slotNum) {
+		size_t slotNum = table->slotNum ? table->slotNum * 2 : 1024;
+		uint32_t *slots = calloc(slotNum,sizeof(uint32_t));
+		check(slots,"Cannot allocate memory for cache\n");
+
+		for (size_t i = 0;i < table->slotNum;i++) {
+			if (!table->slots[i])
+				continue;
+			size_t h = hash_string(table->buf +
+					       table->slots[i] - 1) % slotNum;
+			while (slots[h])
+				h = (h + 1) % slotNum;
+			slots[h] = table->slots[i];
+		}
+
+		free(table->slots);
+		table->slots	= slots;
+		table->slotNum	= slotNum;
 	}
 
-	ioctl(fd,FS_IOC_GETFLAGS,&origin);
-	origin = type ? origin | mask : origin & ~mask;
-	ioctl(fd,FS_IOC_SETFLAGS,&origin);
+	size_t h = hash_string(s) % table->slotNum;
+	for (;table->slots[h];h = (h + 1) % table->slotNum) {
+		if (!strcmp(table->buf + table->slots[h] - 1,s))
+			return table->slots[h] - 1;
+	}
 
-	close(fd);
+	size_t length = strlen(s) + 1;
+	if (table->length + length > table->cap) {
+		size_t cap = (table->cap ? table->cap * 2 : 65536) + length;
+		char *buf = realloc(table->buf,cap);
+		check(buf,"Cannot allocate memory for cache\n");
+		table->buf	= buf;
+		table->cap	= cap;
+	}
 
-	return;
+	uint32_t offset = table->length;
+	memcpy(table->buf + offset,s,length);
+	table->length += length;
+	table->slots[h] = offset + 1;
+	table->used++;
+
+	return offset;
 }
 
-def_handler(attr_attr)
+static void cache_fill_source(Cache_Source *c,const struct stat *st)
 {
-	handler_ignore;
-	do_set_file_attr(path,(void*)arg);
+	c->dev		= st->st_dev;
+	c->ino		= st->st_ino;
+	c->size		= S_ISDIR(st->st_mode) ? 0 : st->st_size;
+	c->mtimeSec	= st->st_mtim.tv_sec;
+	c->mtimeNsec	= st->st_mtim.tv_nsec;
+	c->ctimeSec	= st->st_ctim.tv_sec;
+	c->ctimeNsec	= st->st_ctim.tv_nsec;
 	return;
 }
 
-def_handler(attr_exclude)
+static void cache_save(const char *path)
 {
-	handler_ignore;
+	Str_Table table = { 0 };
+	Cache_Source *sources = calloc(gSources.num + 1,sizeof(Cache_Source));
+	Cache_Entry *entries = calloc(gPlan.num + 1,sizeof(Cache_Entry));
+	check(sources && entries,"Cannot allocate memory for cache\n");
+
+	for (size_t i = 0;i < gSources.num;i++) {
+		Conf_Source *source = &gSources.list[i];
+		sources[i].path		= str_table_add(&table,source->path);
+		sources[i].kind		= source->kind;
+		sources[i].exists	= source->exists;
+		if (source->exists)
+			cache_fill_source(&sources[i],&source->st);
+	}
+
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+		entries[i] = (Cache_Entry) {
+			.attr	= entry->file.attr,
+			.path	= str_table_add(&table,entry->file.path),
+			.mode	= str_table_add(&table,entry->in.modeStr),
+			.user	= str_table_add(&table,entry->in.userName),
+			.group	= str_table_add(&table,entry->in.grpName),
+			.age	= str_table_add(&table,entry->in.ageStr),
+			.arg	= str_table_add(&table,entry->in.arg),
+			.source	= str_table_add(&table,entry->source),
+			.line	= entry->line,
+			.type	= (unsigned char)entry->in.type,
+		};
+	}
 
-	char *t = strdup(path);
-	check(t,"Cannot allocate memory for excluded path %s\n",path);
+	Cache_Header header = {
+				.magic		= CACHE_MAGIC,
+				.version	= CACHE_VERSION,
+				.sourceNum	= gSources.num,
+				.entryNum	= gPlan.num,
+				.strSize	= table.length,
+			      };
+
+	char tmpPath[PATH_MAX];
+	snprintf(tmpPath,sizeof(tmpPath),"%s.%ld",path,(long int)getpid());
+	// Never through a file or link planted in a shared directory
+	int fd = open(tmpPath,O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+			      O_CLOEXEC,0644);
+	if (fd < 0) {
+		log_errno(LOG_WARNING,errno,"Cannot create cache file %s\n",
+			  tmpPath);
+	} else {
+		bool ok = write_all(fd,&header,sizeof(header)) &&
+			  write_all(fd,sources,
+				    sizeof(Cache_Source) * gSources.num) &&
+			  write_all(fd,entries,
+				    sizeof(Cache_Entry) * gPlan.num) &&
+			  write_all(fd,table.buf,table.length);
+		close(fd);
 
-	gArg.excludedCount++;
-	gArg.excludedList = (char**)realloc(gArg.excludedList,
-					    sizeof(char*) * gArg.excludedCount);
-	check(gArg.excludedList,"Cannot allocate memory for excluded path %s\n",
-	      path);
-	gArg.excludedList[gArg.excludedCount - 2] = t;
+		if (!ok || rename(tmpPath,path)) {
+			log_errno(LOG_WARNING,errno,
+				  "Cannot write cache file %s\n",path);
+			unlink(tmpPath);
+		}
+	}
 
+	free(table.buf);
+	free(table.slots);
+	free(sources);
+	free(entries);
 	return;
 }
 
-typedef struct {
-	Entry_Attribute attr;
-	const char *modeStr,*userName,*grpName,*ageStr,*arg;
-} Process_File_In;
+static bool cache_source_valid(const Cache_Source *c,const char *path)
+{
+	struct stat st;
+	if (stat(path,&st))
+		return !c->exists;
+
+	Cache_Source now = { 0 };
+	cache_fill_source(&now,&st);
+	return c->exists				&&
+	       now.dev == c->dev && now.ino == c->ino	&&
+	       now.size == c->size			&&
+	       now.mtimeSec == c->mtimeSec		&&
+	       now.mtimeNsec == c->mtimeNsec		&&
+	       now.ctimeSec == c->ctimeSec		&&
+	       now.ctimeNsec == c->ctimeNsec;
+}
 
 /*
- *	The order in array ctx is important:
- *		attr,modeStr,userName,grpName,age,arg
- *	All are in the same size as a normal pointer
+ *	args are the configuration files given on the command line,they must
+ *	be the same files in the same order. Returns true if the plan is
+ *	loaded.
  */
-static void process_file(const char *path,void *ctx)
+static bool cache_load(const char *path,const char *const *args,
+		       size_t argNum)
 {
-	typedef void (*Attr_Handler)(const char *path,const char *mode,
-				     const char *userName,const char *grpName,
-				     const char *age,const char *arg);
-	static Attr_Handler attrHandler[] =
-		{
-			[1]	= attr_create,
-			[4]	= attr_perm,
-			[5]	= attr_createdir,
-			[8]	= attr_write,
-			[9]	= attr_ownership,
-			[10]	= attr_clean,
-			[11]	= attr_remove,
-			[12]	= attr_attr,
-			[13]	= attr_exclude,
-		};
+	int fd = open(path,O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
 
-	Process_File_In *in = ctx;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd,&st) && (size_t)st.st_size >= sizeof(Cache_Header))
+		map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const Cache_Header *header = map;
+	const Cache_Source *sources = (const void*)(header + 1);
+	const Cache_Entry *entries = (const void*)(sources +
+						   header->sourceNum);
+	const char *strs = (const char*)(entries + header->entryNum);
+	size_t size = st.st_size;
+
+	bool ok = !memcmp(header->magic,CACHE_MAGIC,sizeof(CACHE_MAGIC)) &&
+		  header->version == CACHE_VERSION			&&
+		  sizeof(Cache_Header) +
+		  (uint64_t)header->sourceNum * sizeof(Cache_Source) +
+		  (uint64_t)header->entryNum * sizeof(Cache_Entry) +
+		  header->strSize == size				&&
+		  header->strSize && !strs[header->strSize - 1];
+
+	size_t argIdx = 0;
+	for (size_t i = 0;ok && i < header->sourceNum;i++) {
+		const Cache_Source *source = &sources[i];
+		ok = source->path < header->strSize;
+		if (!ok)
+			break;
+
+		const char *sourcePath = strs + source->path;
+		if (source->kind == SOURCE_DIR && gArg.noDefault) {
+			ok = false;
+		} else if (source->kind == SOURCE_ARG) {
+			ok = argIdx < argNum &&
+			     !strcmp(args[argIdx++],sourcePath);
+		}
+		ok = ok && cache_source_valid(source,sourcePath);
+	}
+	ok = ok && argIdx == argNum;
+
+	// Default directories are always recorded if parsed
+	bool hasDefault = false;
+	for (size_t i = 0;ok && i < header->sourceNum;i++)
+		hasDefault |= sources[i].kind == SOURCE_DIR;
+	ok = ok && hasDefault == !gArg.noDefault;
+
+	for (size_t i = 0;ok && i < header->entryNum;i++) {
+		const Cache_Entry *c = &entries[i];
+		ok = c->path < header->strSize && c->mode < header->strSize &&
+		     c->user < header->strSize && c->group < header->strSize &&
+		     c->age < header->strSize && c->arg < header->strSize &&
+		     c->source < header->strSize;
+	}
+
+	if (!ok) {
+		munmap(map,size);
+		return false;
+	}
+
+	for (size_t i = 0;i < header->entryNum;i++) {
+		const Cache_Entry *c = &entries[i];
+		Plan_Entry *entry = plan_add();
+		entry->file = (File_Entry) {
+					.path	= strs + c->path,
+					.attr	= c->attr,
+				       };
+		entry->in = (Process_File_In) {
+					.attr		= c->attr &
+							  ~ATTR_ONBOOT &
+							  ~ATTR_GLOB,
+					.type		= (char)c->type,
+					.modeStr	= strs + c->mode,
+					.userName	= strs + c->user,
+					.grpName	= strs + c->group,
+					.ageStr		= strs + c->age,
+					.arg		= strs + c->arg,
+				     };
+		entry->source	= strs + c->source;
+		entry->line	= c->line;
+	}
+
+	gPlan.cacheMap	= map;
+	gPlan.cacheSize	= size;
+	return true;
+}
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t dirNum;
+	uint32_t strSize;
+	uint32_t padding;
+	uint64_t excludeHash;
+	int64_t time;
+} Age_Index_Header;
+
+typedef struct {
+	uint64_t dev,ino;
+	int64_t mtimeSec,mtimeNsec,ctimeSec,ctimeNsec;
+	int64_t age,minTime;
+	uint32_t path;
+	uint32_t padding;
+} Age_Index_Dir;
+
+static void age_index_load(const char *path)
+{
+	gAgeIndex.now = time(NULL);
+
+	int fd = open(path,O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd,&st) && (size_t)st.st_size >= sizeof(Age_Index_Header))
+		map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	const Age_Index_Header *header = map;
+	const Age_Index_Dir *dirs = (const void*)(header + 1);
+	const char *strs = (const char*)(dirs + header->dirNum);
+	size_t size = st.st_size;
+
+	bool ok = !memcmp(header->magic,AGE_INDEX_MAGIC,
+			  sizeof(AGE_INDEX_MAGIC))			&&
+		  header->version == AGE_INDEX_VERSION			&&
+		  sizeof(Age_Index_Header) +
+		  (uint64_t)header->dirNum * sizeof(Age_Index_Dir) +
+		  header->strSize == size				&&
+		  header->strSize && !strs[header->strSize - 1]		&&
+		  header->excludeHash == gAgeIndex.excludeHash;
+	for (size_t i = 0;ok && i < header->dirNum;i++)
+		ok = dirs[i].path < header->strSize;
+
+	if (ok && header->dirNum) {
+		gAgeIndex.old = malloc(sizeof(Age_Dir) * header->dirNum);
+		check(gAgeIndex.old,"Cannot allocate memory for age index\n");
+	}
+
+	for (size_t i = 0;ok && i < header->dirNum;i++) {
+		const Age_Index_Dir *c = &dirs[i];
+		Age_Dir *dir = &gAgeIndex.old[i];
+		*dir = (Age_Dir) {
+				.path		= strs + c->path,
+				.dev		= c->dev,
+				.ino		= c->ino,
+				.mtimeSec	= c->mtimeSec,
+				.mtimeNsec	= c->mtimeNsec,
+				.ctimeSec	= c->ctimeSec,
+				.ctimeNsec	= c->ctimeNsec,
+				.age		= c->age,
+			 };
+		// Anything appeared later is newer than the last run
+		atomic_init(&dir->minTime,c->minTime < header->time ?
+					  c->minTime : header->time);
+	}
+
+	if (!ok) {
+		munmap(map,size);
+		return;
+	}
+
+	gAgeIndex.oldNum	= header->dirNum;
+	gAgeIndex.map		= map;
+	gAgeIndex.mapSize	= size;
+	qsort(gAgeIndex.old,gAgeIndex.oldNum,sizeof(Age_Dir),age_dir_cmp);
+	return;
+}
+
+static int age_dir_ptr_cmp(const void *pa,const void *pb)
+{
+	return age_dir_cmp(*(Age_Dir *const*)pa,*(Age_Dir *const*)pb);
+}
+
+static void age_index_save(const char *path)
+{
+	// A file that should have been removed may still be there
+	if (atomic_load(&gCounter.failedRemovals)) {
+		log_info("Age index %s is not updated\n",path);
+		return;
+	}
+
+	/*
+	 *	Recorded directories,then carried ones with their
+	 *	subdirectories cleaned with the same age
+	 */
+	size_t num = 0,cap = gAgeIndex.num + gAgeIndex.oldNum;
+	Age_Dir **dirs = malloc(sizeof(Age_Dir*) * (cap + 1));
+	check(dirs,"Cannot allocate memory for age index\n");
+
+	for (Age_Dir *dir = gAgeIndex.list;dir;dir = dir->next) {
+		if (!dir->dropped)
+			dirs[num++] = dir;
+	}
+	for (size_t i = 0;i < gAgeIndex.oldNum;i++) {
+		Age_Dir *dir = &gAgeIndex.old[i];
+		if (!dir->carried)
+			continue;
+
+		size_t length = strlen(dir->path);
+		dirs[num++] = dir;
+		for (size_t j = i + 1;j < gAgeIndex.oldNum;j++) {
+			Age_Dir *sub = &gAgeIndex.old[j];
+			if (strncmp(sub->path,dir->path,length) ||
+			    sub->path[length] != '/')
+				break;
+			if (sub->age == dir->age && !sub->carried)
+				dirs[num++] = sub;
+		}
+	}
+
+	Str_Table table = { 0 };
+	Age_Index_Dir *out = calloc(num + 1,sizeof(Age_Index_Dir));
+	check(out,"Cannot allocate memory for age index\n");
+
+	qsort(dirs,num,sizeof(Age_Dir*),age_dir_ptr_cmp);
+
+	size_t outNum = 0;
+	for (size_t i = 0;i < num;i++) {
+		Age_Dir *dir = dirs[i];
+		long long int minTime = atomic_load(&dir->minTime);
+
+		// The same directory cleaned twice,keep the earlier time
+		if (outNum && !age_dir_cmp(dir,dirs[i - 1])) {
+			if (minTime < out[outNum - 1].minTime)
+				out[outNum - 1].minTime = minTime;
+			continue;
+		}
+
+		out[outNum++] = (Age_Index_Dir) {
+				.dev		= dir->dev,
+				.ino		= dir->ino,
+				.mtimeSec	= dir->mtimeSec,
+				.mtimeNsec	= dir->mtimeNsec,
+				.ctimeSec	= dir->ctimeSec,
+				.ctimeNsec	= dir->ctimeNsec,
+				.age		= dir->age,
+				.minTime	= minTime,
+				.path		= str_table_add(&table,dir->path),
+			  };
+	}
+
+	Age_Index_Header header = {
+				.magic		= AGE_INDEX_MAGIC,
+				.version	= AGE_INDEX_VERSION,
+				.dirNum		= outNum,
+				.strSize	= table.length,
+				.excludeHash	= gAgeIndex.excludeHash,
+				.time		= gAgeIndex.now,
+			  };
+
+	char tmpPath[PATH_MAX];
+	snprintf(tmpPath,sizeof(tmpPath),"%s.%ld",path,(long int)getpid());
+	int fd = open(tmpPath,O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+			      O_CLOEXEC,0644);
+	if (fd < 0) {
+		log_errno(LOG_WARNING,errno,"Cannot create age index %s\n",
+			  tmpPath);
+	} else {
+		bool ok = write_all(fd,&header,sizeof(header)) &&
+			  write_all(fd,out,sizeof(Age_Index_Dir) * outNum) &&
+			  write_all(fd,table.buf,table.length);
+		close(fd);
 
-	for (int i = 0,mask = 1;
-	     (size_t)i < (sizeof(in->attr) << 3) - 1;
-	     i++) {
-		if (in->attr & mask) {
-			attrHandler[i](path,in->modeStr,in->userName,
-				       in->grpName,in->ageStr,in->arg);
+		if (!ok || rename(tmpPath,path)) {
+			log_errno(LOG_WARNING,errno,
+				  "Cannot write age index %s\n",path);
+			unlink(tmpPath);
 		}
-		mask <<= 1;
 	}
 
+	free(table.buf);
+	free(table.slots);
+	free(out);
+	free(dirs);
 	return;
 }
 
 /*
- *	NOTICE: Glob match will be done in parse_conf()
+ *	Load records of the checkpoint (--resume). The file is kept mapped,
+ *	as records point into it.
  */
-static void parse_conf(FILE *conf)
+static void checkpoint_load(void)
 {
-	static Entry_Attribute attrTableSet[256] = {
-			['w']	= ATTR_WRITE,
-			['f']	= ATTR_CREATE | ATTR_WRITE | ATTR_OWNERSHIP |
-				  ATTR_PERM,
-			['d']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
-				  ATTR_CLEAN,
-			['!']	= ATTR_ONBOOT,
-			['r']	= ATTR_REMOVE | ATTR_GLOB,
-			['D']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
-				  ATTR_CLEAN | ATTR_REMOVE,
-			['q']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
-				  ATTR_CLEAN,
-			['Q']	= ATTR_CREATEDIR | ATTR_OWNERSHIP | ATTR_PERM |
-				  ATTR_CLEAN | ATTR_REMOVE,
-			['h']	= ATTR_ATTR | ATTR_GLOB,
-			['x']	= ATTR_EXCLUDE,
-		};
-	static Entry_Attribute attrTableClear[] = {
-			['+']	= ATTR_WRITE,
-		};
+	int fd = open(gCheckpoint.path,O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd,&st) && (size_t)st.st_size >= sizeof(Checkpoint_Header))
+		map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn("Invalid checkpoint %s,ignored\n",gCheckpoint.path);
+		return;
+	}
+
+	const Checkpoint_Header *header = map;
+	size_t size = st.st_size,off = sizeof(Checkpoint_Header);
+	// Each record takes an entry at least,which bounds the allocation
+	bool ok = !memcmp(header->magic,CHECKPOINT_MAGIC,
+			  sizeof(CHECKPOINT_MAGIC))		&&
+		  header->version == CHECKPOINT_VERSION		&&
+		  header->recordNum <= (size - off) / sizeof(Checkpoint_Entry);
+
+	Checkpoint_Record *records = NULL;
+	size_t recordNum = ok ? header->recordNum : 0;
+	if (recordNum) {
+		memory_charge(sizeof(Checkpoint_Record) * recordNum);
+		records = malloc(sizeof(Checkpoint_Record) * recordNum);
+		check(records,"Cannot allocate memory for checkpoint\n");
+	}
 
-	while (!feof(conf)) {
-		char *typeStr,*pathStr,*modeStr,*userName,*grpName;
-		char *ageStr;
-		int termNum = fscanf(conf,"%ms%ms%ms%ms%ms%ms",
-				     &typeStr,&pathStr,&modeStr,
-				     &userName,&grpName,&ageStr);
+	for (uint32_t i = 0;ok && i < header->recordNum;i++) {
+		Checkpoint_Entry entry;
+		ok = size - off >= sizeof(entry);
+		if (!ok)
+			break;
+		memcpy(&entry,(const char *)map + off,sizeof(entry));
+		off += sizeof(entry);
 
-		if (termNum < 0)
+		const char *strs = (const char *)map + off;
+		uint64_t length = (uint64_t)entry.sourceLen + entry.pathLen +
+				  entry.cursorLen + 3;
+		ok = size - off >= length				&&
+		     !strs[entry.sourceLen]				&&
+		     !strs[entry.sourceLen + entry.pathLen + 1]		&&
+		     !strs[length - 1];
+		if (!ok)
 			break;
+		off += length;
+
+		Checkpoint_Record *r = &records[i];
+		r->source	= strs;
+		r->path		= strs + entry.sourceLen + 1;
+		r->line		= entry.line;
+		r->cursor	= entry.done ? NULL :
+				  r->path + entry.pathLen + 1;
+
+		unsigned int h = hash_string(r->path) % CHECKPOINT_HASH_SIZE;
+		r->next			= gCheckpoint.old[h];
+		gCheckpoint.old[h]	= r;
+	}
+
+	if (!ok || off != size) {
+		log_warn("Invalid checkpoint %s,ignored\n",gCheckpoint.path);
+		memset(gCheckpoint.old,0,sizeof(gCheckpoint.old));
+		memory_uncharge(sizeof(Checkpoint_Record) * recordNum);
+		free(records);
+		munmap(map,size);
+		return;
+	}
+
+	log_info("Resuming from checkpoint %s\n",gCheckpoint.path);
+	gCheckpoint.map		= map;
+	gCheckpoint.mapSize	= size;
+	gCheckpoint.records	= records;
+	gCheckpoint.recordNum	= recordNum;
+	return;
+}
+
+/*
+ *	The checkpoint is saved for the next run if cleaning has stopped,and
+ *	removed if everything is done
+ */
+static void checkpoint_finish(void)
+{
+	// What is left could have expired already
+	if (atomic_load(&gCheckpoint.stopped))
+		atomic_min(&gNextExpiry,time(NULL));
+
+	if (!gCheckpoint.path || gArg.dryRun)
+		;
+	else if (atomic_load(&gCheckpoint.stopped))
+		log_info("Progress is saved to checkpoint %s\n",
+			 gCheckpoint.path);
+	else if (unlink(gCheckpoint.path) && errno != ENOENT)
+		log_errno(LOG_WARNING,errno,"Cannot remove checkpoint %s\n",
+			  gCheckpoint.path);
+
+	for (Checkpoint_Record *r = gCheckpoint.done,*next;r;r = next) {
+		next = r->next;
+		free(r);
+	}
+	memory_uncharge(sizeof(Checkpoint_Record) * gCheckpoint.recordNum);
+	free(gCheckpoint.records);
+	if (gCheckpoint.map)
+		munmap(gCheckpoint.map,gCheckpoint.mapSize);
+	return;
+}
+
+static void age_index_free(void)
+{
+	while (gAgeIndex.list) {
+		Age_Dir *next = gAgeIndex.list->next;
+		age_dir_free(gAgeIndex.list);
+		gAgeIndex.list = next;
+	}
+	free(gAgeIndex.old);
+	if (gAgeIndex.map)
+		munmap(gAgeIndex.map,gAgeIndex.mapSize);
+	return;
+}
+
+static void json_string(FILE *out,const char *s)
+{
+	fputc('"',out);
+	for (;*s;s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out,"\\%c",*s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out,"\\u%04x",*s);
+		else
+			fputc(*s,out);
+	}
+	fputc('"',out);
+	return;
+}
+
+static double ns_to_ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+static int entry_time_cmp(const void *pa,const void *pb)
+{
+	uint64_t a = gStats.entries[*(const size_t*)pa].timeNs;
+	uint64_t b = gStats.entries[*(const size_t*)pb].timeNs;
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+/*
+ *	Print statistics to stdout. Entries of one file are next to each
+ *	other only before sorting,so files are summed up by their name.
+ */
+#define STATS_TOP_ENTRIES	10
+
+static void stats_report(void)
+{
+	FILE *out = stdout;
+	bool json = gArg.stats == STATS_JSON;
+
+	typedef struct {
+		const char *source;
+		size_t entryNum;
+		uint64_t timeNs;
+	} File_Stats;
+	File_Stats *files = calloc(gPlan.num + 1,sizeof(File_Stats));
+	size_t *order = calloc(gPlan.num + 1,sizeof(size_t));
+	check(files && order,"Cannot allocate memory for statistics\n");
 
-		const char *p = skip_space(typeStr);
-		if (p[0] == '#') {		// Comment
-			next_line(conf);
+	size_t fileNum = 0,orderNum = 0;
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+		if (entry->removed)
 			continue;
+
+		size_t j;
+		for (j = 0;j < fileNum;j++) {
+			if (!strcmp(files[j].source,entry->source))
+				break;
 		}
+		if (j == fileNum)
+			files[fileNum++].source = entry->source;
+		files[j].entryNum++;
+		files[j].timeNs += gStats.entries[i].timeNs;
+		order[orderNum++] = i;
+	}
+	qsort(order,orderNum,sizeof(size_t),entry_time_cmp);
 
-		char arg[256];	// FIXME: Fixed max length
-		fgets(arg,256,conf);
-		size_t argLength = strlen(arg);
-		if (arg[argLength- 1] == '\n') {
-			arg[argLength - 1] = '\0';
-			argLength--;
+	if (json) {
+		fprintf(out,"{\"parse_ms\":%.3f,\"execute_ms\":%.3f,"
+			"\"glob_ms\":%.3f,",
+			ns_to_ms(gStats.parseNs),ns_to_ms(gStats.executeNs),
+			ns_to_ms(atomic_load(&gStats.globNs)));
+		fprintf(out,"\"skipped\":%ld,\"calls\":{",
+			atomic_load(&gCounter.skipped));
+		for (int i = 0;i < STAT_NUM;i++)
+			fprintf(out,"%s\"%s\":%ld",i ? "," : "",gStatNames[i],
+				atomic_load(&gStats.counts[i]));
+		fputs("},\"handlers\":{",out);
+		for (size_t i = 0;i < HANDLER_COUNT;i++) {
+			fprintf(out,"%s\"%s\":{\"calls\":%ld,\"ms\":%.3f}",
+				i ? "," : "",gHandlers[i].name,
+				atomic_load(&gStats.handlerCalls[i]),
+				ns_to_ms(atomic_load(&gStats.handlerNs[i])));
 		}
+		fputs("},\"files\":[",out);
+		for (size_t i = 0;i < fileNum;i++) {
+			fputs(i ? ",{\"file\":" : "{\"file\":",out);
+			json_string(out,files[i].source);
+			fprintf(out,",\"entries\":%zu,\"ms\":%.3f}",
+				files[i].entryNum,ns_to_ms(files[i].timeNs));
+		}
+		fputs("],\"entries\":[",out);
+		for (size_t i = 0;i < orderNum;i++) {
+			Plan_Entry *entry = &gPlan.entries[order[i]];
+			Entry_Stats *stats = &gStats.entries[order[i]];
+			fputs(i ? ",{\"path\":" : "{\"path\":",out);
+			json_string(out,entry->file.path);
+			fputs(",\"file\":",out);
+			json_string(out,entry->source);
+			fprintf(out,",\"line\":%u,\"ms\":%.3f",entry->line,
+				ns_to_ms(stats->timeNs));
+			for (int j = 0;j < STAT_NUM;j++)
+				fprintf(out,",\"%s\":%ld",gStatNames[j],
+					atomic_load(&stats->counts[j]));
+			fputc('}',out);
+		}
+		fputs("]}\n",out);
+	} else {
+		fprintf(out,"Parsing:\t%.3f ms\nExecuting:\t%.3f ms\n"
+			"Globbing:\t%.3f ms\n",
+			ns_to_ms(gStats.parseNs),ns_to_ms(gStats.executeNs),
+			ns_to_ms(atomic_load(&gStats.globNs)));
+		fputs("\nSystem calls:\n",out);
+		for (int i = 0;i < STAT_NUM;i++)
+			fprintf(out,"\t%-16s%ld\n",gStatNames[i],
+				atomic_load(&gStats.counts[i]));
+		fprintf(out,"\t%-16s%ld\n","skipped",
+			atomic_load(&gCounter.skipped));
 
-		Entry_Attribute attr = 0x00;
-		for (int i = 0;p[i];p++) {
-			if (!attrTableSet[(int)p[i]])
-				log_warn("Invalid type %c\n",p[i]);
-			attr |= attrTableSet[(int)p[i]];
-			attr &= ~attrTableClear[(int)p[i]];
+		fputs("\nHandlers:\t\tcalls\ttime (ms)\n",out);
+		for (size_t i = 0;i < HANDLER_COUNT;i++) {
+			fprintf(out,"\t%-16s%ld\t%.3f\n",gHandlers[i].name,
+				atomic_load(&gStats.handlerCalls[i]),
+				ns_to_ms(atomic_load(&gStats.handlerNs[i])));
 		}
 
-		if ((attr & ATTR_ONBOOT) && !gArg.boot)	// Handler '!'
-			continue;
+		fputs("\nFiles:\t\t\tentries\ttime (ms)\n",out);
+		for (size_t i = 0;i < fileNum;i++)
+			fprintf(out,"\t%s\n\t\t\t\t%zu\t%.3f\n",files[i].source,
+				files[i].entryNum,ns_to_ms(files[i].timeNs));
 
-		char dummy[1] = "";
-		Process_File_In in = {
-					.attr		= attr & ~ATTR_ONBOOT &
-							  ~ATTR_GLOB,
-					.modeStr	= modeStr ? modeStr :
-								    dummy,
-					.userName	= userName ? userName :
-								     dummy,
-					.grpName	= grpName ? grpName :
-								    dummy,
-					.ageStr		= ageStr ? ageStr :
-								   dummy,
-					.arg		= skip_space(arg),
-				     };
-		if (attr & ATTR_GLOB) {
-			glob_match(pathStr,process_file,(void*)&in);
-		} else {
-			process_file(pathStr,(void*)&in);
+		fputs("\nSlowest entries:\t\tcalls\ttime (ms)\n",out);
+		for (size_t i = 0;i < orderNum && i < STATS_TOP_ENTRIES;i++) {
+			Plan_Entry *entry = &gPlan.entries[order[i]];
+			Entry_Stats *stats = &gStats.entries[order[i]];
+			long int calls = 0;
+			for (int j = 0;j < STAT_WRITTEN;j++)
+				calls += atomic_load(&stats->counts[j]);
+			fprintf(out,"\t%s:%u %s\n\t\t\t\t%ld\t%.3f\n",
+				entry->source,entry->line,entry->file.path,
+				calls,ns_to_ms(stats->timeNs));
 		}
-
-		free_if(6,typeStr,pathStr,modeStr,userName,grpName,ageStr);
 	}
 
+	free(files);
+	free(order);
 	return;
 }
 
-static void read_conf(const char *path,void *ctx)
+/*
+ *	Print the changes a dry run found,then the entries needing any system
+ *	call in configuration order.
+ */
+static void estimate_report(void)
 {
-	(void)ctx;
-	FILE *conf = fopen(path,"r");
-	if (!conf) {
-		log_warn("Cannot open configuration file %s\n",path);
-		return;
-	}
+	FILE *out = stdout;
+
+	fputs("Changes:\n",out);
+	for (int i = 0;i < DRY_NUM;i++)
+		fprintf(out,"\t%-16s%ld\n",gDryNames[i],
+			atomic_load(&gDryRun.counts[i]));
+	fprintf(out,"\t%-16s%llu\n","bytes_reclaimed",
+		atomic_load(&gDryRun.reclaimed));
+	fprintf(out,"\t%-16s%ld\n","bytes_written",
+		atomic_load(&gStats.counts[STAT_WRITTEN]));
 
-	parse_conf(conf);
-	fclose(conf);
+	fputs("\nSystem calls:\n",out);
+	for (int i = 0;i < STAT_WRITTEN;i++)
+		fprintf(out,"\t%-16s%ld\n",gStatNames[i],
+			atomic_load(&gStats.counts[i]));
+
+	fputs("\nEntries:\n",out);
+	for (size_t i = 0;i < gPlan.num;i++) {
+		Plan_Entry *entry = &gPlan.entries[i];
+		if (entry->removed)
+			continue;
+
+		long int calls = 0;
+		for (int j = 0;j < STAT_WRITTEN;j++)
+			calls += atomic_load(&gStats.entries[i].counts[j]);
+		if (calls)
+			fprintf(out,"\t%s:%u\t%ld\t%s\n",entry->source,
+				entry->line,calls,entry->file.path);
+	}
 	return;
 }
 
+// Size with an optional K,M or G suffix,0 if invalid
+static size_t parse_size(const char *s)
+{
+	char *end;
+	errno = 0;
+	unsigned long long int size = strtoull(s,&end,10);
+	if (errno || end == s)
+		return 0;
+
+	const char *units = "KMG";
+	const char *unit = *end ? strchr(units,toupper((unsigned char)*end)) :
+				  NULL;
+	if (*end && (!unit || end[1]))
+		return 0;
+	for (const char *u = units;unit && u <= unit;u++)
+		size *= 1024;
+	return size;
+}
+
 static void usage(const char *name)
 {
 	fprintf(stderr,"%s:\n\t%s ",name,name);
@@ -653,7 +6247,48 @@ static void usage(const char *name)
 	fputs("--boot\t\tEnable entries marked on-boot-only ('!' modifier)\n",
 	      stderr);
 	fputs("--no-default\tDo not parse the default configuration\n",stderr);
+	fputs("--jobs N\tRun entries,clean and remove with N parallel jobs\n",
+	      stderr);
+	fputs("--create-first\tCreate and write everything before cleaning and "
+	      "removing,\n\t\twhich are done with idle priority\n",stderr);
+	fputs("--ready-fd FD\tWrite READY=1 to FD when everything is created\n",
+	      stderr);
+	fputs("--ready-file PATH\tCreate PATH when everything is created\n",
+	      stderr);
+	fputs("--io-uring\tBatch removals and status queries with io_uring\n",
+	      stderr);
+	fputs("--cache PATH\tLoad the parsed configuration from PATH,or save "
+	      "it there\n",stderr);
+	fputs("--checkpoint PATH\tSave the progress of cleaning to PATH "
+	      "regularly\n",stderr);
+	fputs("--resume\tContinue cleaning from the checkpoint\n",stderr);
+	fputs("--time-budget SECONDS\tStop cleaning after SECONDS,saving the "
+	      "progress\n",stderr);
+	fputs("--age-index PATH\tSkip cleaning subtrees that have nothing "
+	      "expired,as\n\t\trecorded in PATH by the last run\n",stderr);
 	fputs("--log\t\tSpecify the log file\n",stderr);
+	fputs("--log-level LEVEL\tPrint messages up to LEVEL,error,warning "
+	      "(default)\n\t\tor info\n",stderr);
+	fputs("--log-target TARGET\tPrint messages to the log file (stream),"
+	      "journal\n\t\tor syslog\n",stderr);
+	fputs("--verbose\tPrint informational messages,as --log-level info\n",
+	      stderr);
+	fputs("--max-memory SIZE\tFail instead of using more memory than SIZE,"
+	      "\n\t\twith an optional K,M or G suffix\n",stderr);
+	fputs("--root DIR\tProcess the root DIR,may be given several times\n",
+	      stderr);
+	fputs("--until-next\tAfter cleaning,sleep until the next file expires\n",
+	      stderr);
+	fputs("--watch\t\tKeep running after cleaning,and clean directories again "
+	      "when\n\t\tfiles in them expire\n",stderr);
+	fputs("--dry-run\tPrint changes to make instead of making them\n",
+	      stderr);
+	fputs("--estimate\tDry run printing numbers of changes,bytes to reclaim "
+	      "and\n\t\tsystem calls per entry\n",stderr);
+	fputs("--stats[=json]\tPrint time and system calls spent on handlers "
+	      "and entries\n",stderr);
+	fputs("--metrics-file PATH\tWrite metrics of the run to PATH for "
+	      "the textfile\n\t\tcollector of node_exporter\n",stderr);
 	fputs("--help\t\tPrint this help\n",stderr);
 	fputs("Refer to systemd-tmpfiles manual for details\n",stderr);
 	fputs("pawprint is a part of eweOS project,"
@@ -665,7 +6300,9 @@ static void usage(const char *name)
 int main(int argc,const char *argv[])
 {
 	gLogStream = stderr;
-	int confIdx = 1;
+	setvbuf(gLogStream,NULL,_IOFBF,LOG_BUFFER_SIZE);
+	gArg.readyFd = -1;
+	int confIdx = argc;
 	for (int i = 1;i < argc;i++) {
 		if (!strcmp(argv[i],"--clean")) {
 			gArg.clean = 1;
@@ -677,13 +6314,96 @@ int main(int argc,const char *argv[])
 			gArg.boot = 1;
 		} else if (!strcmp(argv[i],"--no-default")) {
 			gArg.noDefault = 1;
-		} else if (!strcmp(argv[i],"--log")) {
-			FILE *t = fopen(argv[i + 1],"a");
-			if (!t)
-				log_warn("Cannot open log file %s\n",
-					 argv[i + 1]);
-			gLogStream = t;
+		} else if (!strcmp(argv[i],"--jobs")) {
+			check(i + 1 < argc,"--jobs requires an argument\n");
+			gArg.jobs = atoi(argv[i + 1]);
+			check(gArg.jobs > 0,"Invalid job number %s\n",
+			      argv[i + 1]);
 			i++;
+		} else if (!strcmp(argv[i],"--io-uring")) {
+			gArg.ioUring = true;
+		} else if (!strcmp(argv[i],"--cache")) {
+			check(i + 1 < argc,"--cache requires an argument\n");
+			gArg.cachePath = argv[++i];
+		} else if (!strcmp(argv[i],"--create-first")) {
+			gArg.createFirst = true;
+		} else if (!strcmp(argv[i],"--ready-fd")) {
+			check(i + 1 < argc,"--ready-fd requires an argument\n");
+			gArg.readyFd = atoi(argv[++i]);
+		} else if (!strcmp(argv[i],"--ready-file")) {
+			check(i + 1 < argc,"--ready-file requires an argument\n");
+			gArg.readyFile = argv[++i];
+		} else if (!strcmp(argv[i],"--age-index")) {
+			check(i + 1 < argc,"--age-index requires an argument\n");
+			gArg.ageIndexPath = argv[++i];
+		} else if (!strcmp(argv[i],"--checkpoint")) {
+			check(i + 1 < argc,"--checkpoint requires an argument\n");
+			gCheckpoint.path = argv[++i];
+			atomic_store(&gCheckpoint.nextNs,monotonic_ns() +
+					CHECKPOINT_INTERVAL * 1000000000ull);
+		} else if (!strcmp(argv[i],"--resume")) {
+			gCheckpoint.resume = true;
+		} else if (!strcmp(argv[i],"--time-budget")) {
+			check(i + 1 < argc,"--time-budget requires an argument\n");
+			char *end;
+			long int budget = strtol(argv[++i],&end,10);
+			check(budget > 0 && !*end,"Invalid time budget %s\n",
+			      argv[i]);
+			gCheckpoint.budgetNs = monotonic_ns() +
+					       budget * 1000000000ull;
+		} else if (!strcmp(argv[i],"--max-memory")) {
+			check(i + 1 < argc,"--max-memory requires an argument\n");
+			gMemory.limit = parse_size(argv[++i]);
+			check(gMemory.limit,"Invalid memory limit %s\n",argv[i]);
+		} else if (!strcmp(argv[i],"--root")) {
+			check(i + 1 < argc,"--root requires an argument\n");
+			if (!gRoots.list) {
+				gRoots.list = calloc(argc,sizeof(Root));
+				check(gRoots.list,
+				      "Cannot allocate memory for roots\n");
+			}
+			gRoots.list[gRoots.num++].path = argv[++i];
+		} else if (!strcmp(argv[i],"--until-next")) {
+			gArg.untilNext = true;
+		} else if (!strcmp(argv[i],"--watch")) {
+			gArg.watch = true;
+		} else if (!strcmp(argv[i],"--dry-run")) {
+			gArg.dryRun = true;
+		} else if (!strcmp(argv[i],"--estimate")) {
+			gArg.dryRun = gArg.estimate = true;
+		} else if (!strcmp(argv[i],"--stats")) {
+			gArg.stats = STATS_TEXT;
+		} else if (!strcmp(argv[i],"--stats=json")) {
+			gArg.stats = STATS_JSON;
+		} else if (!strcmp(argv[i],"--metrics-file")) {
+			check(i + 1 < argc,"--metrics-file requires an argument\n");
+			gMetrics.path = argv[++i];
+		} else if (!strcmp(argv[i],"--verbose")) {
+			gLog.level = LOG_INFO;
+		} else if (!strcmp(argv[i],"--log-level")) {
+			check(i + 1 < argc,"--log-level requires an argument\n");
+			const char *name = argv[++i];
+			int level = !strcmp(name,"error")	? LOG_ERR	:
+				    !strcmp(name,"warning")	? LOG_WARNING	:
+				    !strcmp(name,"info")	? LOG_INFO	:
+								  -1;
+			check(level >= 0,"Invalid log level %s\n",name);
+			gLog.level = level;
+		} else if (!strcmp(argv[i],"--log-target")) {
+			check(i + 1 < argc,"--log-target requires an argument\n");
+			log_set_target(argv[++i]);
+		} else if (!strcmp(argv[i],"--log")) {
+			check(i + 1 < argc,"--log requires an argument\n");
+			FILE *t = fopen(argv[++i],"a");
+			if (t) {
+				setvbuf(t,NULL,_IOFBF,LOG_BUFFER_SIZE);
+				if (gLogStream != stderr)
+					fclose(gLogStream);
+				gLogStream = t;
+			} else {
+				log_errno(LOG_WARNING,errno,
+					  "Cannot open log file %s\n",argv[i]);
+			}
 		} else if (!strcmp(argv[i],"--help") ||
 			   !strcmp(argv[i],"-h")) {
 			usage(argv[0]);
@@ -694,22 +6414,134 @@ int main(int argc,const char *argv[])
 		}
 	}
 
-	gArg.excludedList = malloc(sizeof(char*));
-	gArg.excludedCount = 1;
-	gArg.excludedList[0] = NULL;
-	check(gArg.excludedList,"Cannot allocate memory for excluded path");
+	/*	Now no options are recognised	*/
+	if (gArg.estimate && !gArg.stats)
+		gArg.stats = STATS_QUIET;
+	// Every removal is reported where it is made
+	if (gArg.dryRun)
+		gArg.ioUring = false;
+	check(!gCheckpoint.resume || gCheckpoint.path,
+	      "--resume requires --checkpoint\n");
+	if (gArg.watch) {
+		check(gArg.clean && !gArg.dryRun,
+		      "--watch requires --clean and cannot be a dry run\n");
+		check(!gCheckpoint.path && !gCheckpoint.budgetNs,
+		      "--watch cannot be used with --checkpoint or "
+		      "--time-budget\n");
+		gWatch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		check_errno(gWatch.fd >= 0,"Cannot initialise inotify\n");
+	}
 
-	if (!gArg.noDefault) {
-		iterate_directory("/etc/tmpfiles.d",read_conf,NULL,true);
-		iterate_directory("/lib/tmpfiles.d",read_conf,NULL,true);
+	// The file is outside of the roots
+	if (gMetrics.path) {
+		check(!gArg.watch || gRoots.num <= 1,
+		      "--metrics-file cannot be used with --watch and several "
+		      "roots\n");
+		if (strchr(gMetrics.path,'/')) {
+			gMetrics.dirFd = open_parent(gMetrics.path,
+						     &gMetrics.name);
+		} else {
+			gMetrics.name	= gMetrics.path;
+			gMetrics.dirFd	= open(".",O_RDONLY | O_DIRECTORY |
+						   O_CLOEXEC);
+		}
+		check_errno(gMetrics.dirFd >= 0,
+			    "Cannot open the directory of metrics file %s\n",
+			    gMetrics.path);
 	}
 
-	/*	Now no options are recognised	*/
-	for (;confIdx < argc;confIdx++)
-		read_conf(argv[confIdx],NULL);
+	uint64_t start = monotonic_ns();
+	check(!gRoots.num || !gArg.cachePath,
+	      "--cache cannot be used with --root\n");
+	if (gRoots.num) {
+		roots_read(argv + confIdx,argc - confIdx);
+		roots_run();
+	} else if (gArg.cachePath &&
+	    cache_load(gArg.cachePath,argv + confIdx,argc - confIdx)) {
+		log_info("Configuration loaded from cache %s\n",gArg.cachePath);
+	} else {
+		if (!gArg.noDefault)
+			read_conf_dirs((const char *[]) { "/etc/tmpfiles.d",
+							  "/lib/tmpfiles.d" },
+				       2);
 
-	fclose(gLogStream);
-	free(gArg.excludedList);
+		for (int i = confIdx;i < argc;i++)
+			read_conf(argv[i],SOURCE_ARG);
+
+		// A dry run writes nothing,like the age index and checkpoints
+		if (gArg.cachePath && !gArg.dryRun)
+			cache_save(gArg.cachePath);
+	}
+
+	plan_resolve();
+	gStats.parseNs = monotonic_ns() - start;
+
+	// The index only changes when cleaning,and is in memory with --watch
+	if (!gArg.clean || gArg.watch)
+		gArg.ageIndexPath = NULL;
+	if (gArg.ageIndexPath)
+		age_index_load(gArg.ageIndexPath);
+	if (!gArg.clean)
+		gCheckpoint.path = NULL;
+	if (gCheckpoint.path && gCheckpoint.resume)
+		checkpoint_load();
+
+	start = monotonic_ns();
+	plan_execute();
+	gStats.executeNs = monotonic_ns() - start;
+	checkpoint_finish();
+
+	// --watch never exits,so metrics of the first pass are written
+	if (gArg.watch) {
+		if (gMetrics.path)
+			metrics_save();
+		watch_run();
+	}
+
+	if (gArg.ageIndexPath && !gArg.dryRun)
+		age_index_save(gArg.ageIndexPath);
+
+	if (gArg.stats == STATS_TEXT || gArg.stats == STATS_JSON)
+		stats_report();
+	if (gArg.estimate)
+		estimate_report();
+
+	log_info("%ld unchanged modes,ownerships,attributes and contents "
+		 "skipped\n",atomic_load(&gCounter.skipped));
+	if (gArg.ageIndexPath)
+		log_info("%ld directories skipped by the age index\n",
+			 atomic_load(&gCounter.skippedDirs));
+
+	// Written by the end of the run,not after --until-next
+	if (gMetrics.path)
+		metrics_save();
+
+	long long int next = atomic_load(&gNextExpiry);
+	if (next != LLONG_MAX) {
+		long long int left = next - time(NULL);
+		log_info("Next expiry in %lld s\n",left > 0 ? left : 0);
+		if (gArg.untilNext)
+			clean_until_next();
+	}
+
+	log_close();
+	id_cache_free(&gUserCache);
+	id_cache_free(&gGroupCache);
+	plan_free();
+	age_index_free();
+	free(gSources.list);
+	for (size_t i = 0;i < gRoots.num;i++)
+		free(gRoots.list[i].confs);
+	free(gRoots.list);
+	free(gRoots.texts);
+	for (Metrics *m = gMetrics.list,*next;m;m = next) {
+		next = m->next;
+		free(m);
+	}
+	if (gMetrics.path)
+		close(gMetrics.dirFd);
+	free(tWalkBatch);
+	io_release();
 
 	return 0;
 }